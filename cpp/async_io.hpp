@@ -0,0 +1,419 @@
+/*-----------------------------------------------------------------------------
+ *
+ *  Copyright(C): 2017
+ *
+ *  Asynchronous IO backend : io_uring, or a pread/pwrite thread pool
+ *
+ * ----------------------------------------------------------------------------*/
+
+#ifndef _ASYNC_IO_H
+#define _ASYNC_IO_H
+
+#include <deque>
+#include <future>
+#include <atomic>
+#include <stdexcept>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <boost/thread.hpp>
+
+// io_uring is built in wherever the kernel headers carry it, unless
+// -DNO_IO_URING asks for the thread pool alone
+#if !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// IORING_OP_READ/WRITE came with this feature bit
+#ifdef IORING_FEAT_RW_CUR_POS
+#define USE_IO_URING
+#endif
+#endif
+#endif
+
+#include "storage_allocator.hpp"
+
+// requests queued before they are handed over in one submission
+#define ASYNCIO_BATCH (32)
+#define ASYNCIO_QUEUE_DEPTH (128)
+#define ASYNCIO_POOL_THREADS (4)
+// O_DIRECT needs offset, length and buffer aligned to this
+#define ASYNCIO_DIRECT_ALIGN (4096)
+
+// IO backend submitting reads and writes to the kernel instead of copying
+// through the mapping. ReadAsync/WriteAsync queue a request and return a
+// future on the byte count; requests go out in batches of ASYNCIO_BATCH,
+// or on Submit(). Buffers have to stay alive until the future is ready.
+//
+// Requests go through an io_uring set up with raw syscalls, or through a
+// pool of threads doing pread/pwrite if the headers lack it, the build
+// sets NO_IO_URING, or the kernel refuses the ring.
+//
+// Read/Write/Address/Discard make it a drop-in IO for Registry and
+// PersistentLinkList. Address still points into the mapping, which
+// shares the page cache with the buffered descriptor.
+class AsyncIO {
+
+    public :
+
+       AsyncIO(StorageResource& sink, const std::string& filepath, bool direct = false) :
+          _sink(sink), _direct_fd(-1), _ring_fd(-1), _inflight(0), _stop(false) {
+          _fd = ::open(filepath.c_str(), O_RDWR);
+          if (_fd < 0)
+             throw std::runtime_error("Cannot open " + filepath);
+          if (direct) {
+             _direct_fd = ::open(filepath.c_str(), O_RDWR | O_DIRECT);
+             if (_direct_fd < 0)
+                BOOST_LOG_TRIVIAL(info) << "O_DIRECT not supported on " << filepath;
+          }
+
+          if (!SetupRing()) {
+             for (int i = 0; i < ASYNCIO_POOL_THREADS; i++)
+               _workers.create_thread(boost::bind(&AsyncIO::Worker, this));
+          }
+          BOOST_LOG_TRIVIAL(debug) << "AsyncIO backend "
+              << ((_ring_fd >= 0) ? "io_uring" : "thread pool");
+       }
+
+      ~AsyncIO() {
+          Submit();
+          {
+             boost::mutex::scoped_lock lock(_lock);
+            _stop = true;
+          }
+          if (_ring_fd >= 0) {
+             WakeReaper();
+            _reaper.join();
+             TeardownRing();
+          } else {
+            _ready.notify_all();
+            _workers.join_all();
+          }
+          if (_direct_fd >= 0)
+             ::close(_direct_fd);
+          ::close(_fd);
+      }
+
+       std::future<ssize_t> ReadAsync(off_t pos, char *buf, size_t size) {
+          return Queue(false, pos, buf, size);
+       }
+
+       std::future<ssize_t> WriteAsync(off_t pos, const char *buf, size_t size) {
+          return Queue(true, pos, (char*)buf, size);
+       }
+
+       // Hand all queued requests over with one submission
+       void Submit(void) {
+          std::deque<Request*> batch;
+          {
+             boost::mutex::scoped_lock lock(_lock);
+             batch.swap(_queued);
+          }
+          if (batch.empty())
+             return;
+          if (_ring_fd >= 0)
+             return SubmitRing(batch);
+          {
+             boost::mutex::scoped_lock lock(_lock);
+            _pending.insert(_pending.end(), batch.begin(), batch.end());
+          }
+         _ready.notify_all();
+       }
+
+       void Read(off_t pos, char *buf, size_t size) {
+          auto done = ReadAsync(pos, buf, size);
+          Submit();
+          Complete(done.get(), false, pos, buf, size);
+       }
+
+       void Write(off_t pos, const char *buf, size_t size) {
+          auto done = WriteAsync(pos, buf, size);
+          Submit();
+          Complete(done.get(), true, pos, (char*)buf, size);
+       }
+
+       char* Address(off_t pos, size_t size) {
+          return _sink.Address(pos, size);
+       }
+
+       void Discard(off_t pos, size_t size) {
+          _sink.Discard(pos, size);
+       }
+
+       void Advise(off_t pos, size_t size, int advice) {
+          _sink.Advise(pos, size, advice);
+       }
+
+       void MarkDirty(off_t pos, size_t size) {
+          _sink.MarkDirty(pos, size);
+       }
+
+       // Writes land in the page cache through the descriptor, so the
+       // range is not looked at : this is a full Barrier over the file.
+       // Only completed writes are covered.
+       void Sync(off_t, size_t) {
+          Barrier();
+       }
+
+       void Barrier(void) {
+          if (fdatasync(_fd) < 0)
+             BOOST_LOG_TRIVIAL(error) << "fdatasync failed";
+       }
+
+       // Buffer usable for O_DIRECT requests
+       static boost::shared_ptr<char> Buffer(size_t size) {
+          void *p = nullptr;
+          if (posix_memalign(&p, ASYNCIO_DIRECT_ALIGN, size))
+             throw std::bad_alloc();
+          return boost::shared_ptr<char>((char*)p, free);
+       }
+
+    private :
+
+       struct Request {
+          bool write;
+          int fd;
+          off_t pos;
+          char *buf;
+          size_t size;
+          std::promise<ssize_t> done;
+       };
+
+       std::future<ssize_t> Queue(bool write, off_t pos, char *buf, size_t size) {
+          auto req = new Request();
+          req->write = write;
+          req->pos = pos;
+          req->buf = buf;
+          req->size = size;
+          // only fully aligned requests can bypass the page cache
+          req->fd = (_direct_fd >= 0 && !(pos % ASYNCIO_DIRECT_ALIGN) &&
+              !(size % ASYNCIO_DIRECT_ALIGN) &&
+              !((uintptr_t)buf % ASYNCIO_DIRECT_ALIGN)) ? _direct_fd : _fd;
+          auto done = req->done.get_future();
+
+          bool full;
+          {
+             boost::mutex::scoped_lock lock(_lock);
+            _queued.push_back(req);
+             full = _queued.size() >= ASYNCIO_BATCH;
+          }
+          if (full)
+             Submit();
+          return done;
+       }
+
+       // Finish a short or failed transfer synchronously
+       void Complete(ssize_t n, bool write, off_t pos, char *buf, size_t size) {
+          size_t done = (n > 0) ? n : 0;
+          while (done < size) {
+             n = write ? pwrite(_fd, buf + done, size - done, pos + done) :
+                 pread(_fd, buf + done, size - done, pos + done);
+             if (n <= 0) {
+                BOOST_LOG_TRIVIAL(error) << "AsyncIO " << (write ? "write" : "read")
+                    << " failed at " << pos + done;
+                throw std::runtime_error("AsyncIO transfer failed");
+             }
+             done+=n;
+          }
+       }
+
+       // Thread pool fallback
+       void Worker(void) {
+          while (1) {
+             Request *req;
+             {
+                boost::mutex::scoped_lock lock(_lock);
+                while (_pending.empty() && !_stop)
+                  _ready.wait(lock);
+                if (_pending.empty())
+                   return;
+                req = _pending.front();
+               _pending.pop_front();
+             }
+             ssize_t n = req->write ? pwrite(req->fd, req->buf, req->size, req->pos) :
+                 pread(req->fd, req->buf, req->size, req->pos);
+             req->done.set_value(n < 0 ? -errno : n);
+             delete req;
+          }
+       }
+
+#ifdef USE_IO_URING
+       bool SetupRing(void) {
+          struct io_uring_params p;
+          memset(&p, 0, sizeof(p));
+          int fd = syscall(__NR_io_uring_setup, ASYNCIO_QUEUE_DEPTH, &p);
+          if (fd < 0) {
+             BOOST_LOG_TRIVIAL(info) << "io_uring unavailable, using a thread pool";
+             return false;
+          }
+
+         _sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+         _cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+         _sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+         _sq = (char*)mmap(0, _sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_SQ_RING);
+         _cq = (char*)mmap(0, _cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+         _sqes = (struct io_uring_sqe*)mmap(0, _sqes_len, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+          if (_sq == MAP_FAILED || _cq == MAP_FAILED || _sqes == MAP_FAILED) {
+             ::close(fd);
+             return false;
+          }
+         _ring_fd = fd;
+         _params = p;
+         _reaper = boost::thread(boost::bind(&AsyncIO::Reaper, this));
+          return true;
+       }
+
+       void TeardownRing(void) {
+          munmap(_sqes, _sqes_len);
+          munmap(_cq, _cq_len);
+          munmap(_sq, _sq_len);
+          ::close(_ring_fd);
+       }
+
+       unsigned* SQ(unsigned off) { return (unsigned*)(_sq + off); }
+       unsigned* CQ(unsigned off) { return (unsigned*)(_cq + off); }
+
+       // Producer side, serialized by _ring_lock
+       void PushSQE(uint8_t opcode, Request *req) {
+          const unsigned mask = *SQ(_params.sq_off.ring_mask);
+          unsigned tail = *SQ(_params.sq_off.tail);
+          // ring full : let the kernel consume what is there
+          while (tail - __atomic_load_n(SQ(_params.sq_off.head), __ATOMIC_ACQUIRE) ==
+                 _params.sq_entries)
+             syscall(__NR_io_uring_enter, _ring_fd, _params.sq_entries, 0, 0, NULL, 0);
+
+          unsigned idx = tail & mask;
+          auto sqe = &_sqes[idx];
+          memset(sqe, 0, sizeof(*sqe));
+          sqe->opcode = opcode;
+          if (req) {
+             sqe->fd = req->fd;
+             sqe->off = req->pos;
+             sqe->addr = (uint64_t)(uintptr_t)req->buf;
+             sqe->len = req->size;
+          }
+          sqe->user_data = (uint64_t)(uintptr_t)req;
+          SQ(_params.sq_off.array)[idx] = idx;
+          __atomic_store_n(SQ(_params.sq_off.tail), tail + 1, __ATOMIC_RELEASE);
+       }
+
+       void SubmitRing(std::deque<Request*>& batch) {
+          boost::mutex::scoped_lock lock(_ring_lock);
+         _inflight+=batch.size();
+          for (auto req : batch)
+             PushSQE(req->write ? IORING_OP_WRITE : IORING_OP_READ, req);
+          unsigned n = batch.size();
+          while (n) {
+             int ret = syscall(__NR_io_uring_enter, _ring_fd, n, 0, 0, NULL, 0);
+             if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                throw std::runtime_error("io_uring submission failed");
+             if (ret > 0)
+                n-=std::min<unsigned>(n, ret);
+          }
+       }
+
+       // A NOP without a request tells the reaper to check _stop, it
+       // leaves once the last request in flight has completed
+       void WakeReaper(void) {
+          boost::mutex::scoped_lock lock(_ring_lock);
+          PushSQE(IORING_OP_NOP, nullptr);
+          syscall(__NR_io_uring_enter, _ring_fd, 1, 0, 0, NULL, 0);
+       }
+
+       void Reaper(void) {
+          const unsigned mask = *CQ(_params.cq_off.ring_mask);
+          auto cqes = (struct io_uring_cqe*)(_cq + _params.cq_off.cqes);
+          bool stopping = false;
+          while (1) {
+             syscall(__NR_io_uring_enter, _ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+             unsigned head = *CQ(_params.cq_off.head);
+             bool wake = false;
+             while (head != __atomic_load_n(CQ(_params.cq_off.tail), __ATOMIC_ACQUIRE)) {
+                auto cqe = &cqes[head & mask];
+                auto req = (Request*)(uintptr_t)cqe->user_data;
+                if (req) {
+                   req->done.set_value(cqe->res);
+                   delete req;
+                  _inflight--;
+                } else
+                   wake = true;
+                head++;
+             }
+             __atomic_store_n(CQ(_params.cq_off.head), head, __ATOMIC_RELEASE);
+             if (wake || stopping) {
+                boost::mutex::scoped_lock lock(_lock);
+               stopping = _stop;
+                if (stopping && !_inflight)
+                   return;
+             }
+          }
+       }
+
+       struct io_uring_params _params;
+       char *_sq, *_cq;
+       struct io_uring_sqe *_sqes;
+       size_t _sq_len, _cq_len, _sqes_len;
+       boost::thread _reaper;
+#else
+       bool SetupRing(void) { return false; }
+       void TeardownRing(void) {}
+       void WakeReaper(void) {}
+       void SubmitRing(std::deque<Request*>&) {}
+       struct { void join(void) {} } _reaper;
+#endif
+
+       StorageResource& _sink;
+       int _fd;
+       int _direct_fd;
+       int _ring_fd;
+       std::atomic<size_t> _inflight;
+
+       // queued until the next submission
+       std::deque<Request*> _queued;
+       // submitted, waiting for a pool thread
+       std::deque<Request*> _pending;
+       bool _stop;
+       boost::mutex _lock;
+       boost::mutex _ring_lock;
+       boost::condition_variable _ready;
+       boost::thread_group _workers;
+};
+
+void TestAsyncIO(void) {
+    const size_t size = 64*1024*1024;
+    const std::string file("async.txt");
+    remove(path(file));
+    {
+       StorageResource sink(file, size);
+       AsyncIO io(sink, file, true);
+
+       // many small writes, one submission
+       std::vector<uint64_t> vals(1000);
+       std::vector<std::future<ssize_t>> done;
+       for (size_t i = 0; i < vals.size(); i++) {
+          vals[i] = i;
+          done.push_back(io.WriteAsync(size - 4096 * (i % 16) - 8 * (i + 1),
+              (char*)&vals[i], sizeof(uint64_t)));
+       }
+       io.Submit();
+       size_t bad = 0;
+       for (auto &f : done)
+          bad += (f.get() != sizeof(uint64_t));
+
+       // aligned buffer, goes through O_DIRECT when available
+       auto buf = AsyncIO::Buffer(ASYNCIO_DIRECT_ALIGN);
+       memset(buf.get(), 0xab, ASYNCIO_DIRECT_ALIGN);
+       io.Write(0, buf.get(), ASYNCIO_DIRECT_ALIGN);
+       uint64_t v = 0;
+       io.Read(8, (char*)&v, sizeof(v));
+       std::cout << "failed writes " << bad << " read back " << std::hex << v
+                 << std::dec << std::endl;
+    }
+    remove(path(file));
+}
+
+#endif
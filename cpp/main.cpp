@@ -16,11 +16,14 @@
 #include "bptnode.h"
 #include "bptree.h"
 #include "vlinklist.hpp"
+#include "async_io.hpp"
 
 #include "boost_logger.h"
 
 const char* dbfile = "log.txt";
-size_t dbsize = 1024*1024*1024;
+// initial size, the file grows a slab at a time
+size_t dbsize = 64*1024*1024;
+size_t slabsize = 64*1024*1024;
 
 db::registryrecord::PersistenceType
 GetIndex(char *str) {
@@ -64,6 +67,13 @@ struct options {
    char *parent;
    bool print;
    bool snapshot;
+   bool compact;
+   bool test;
+   int bench;
+   int storage; // StorageResource flags
+   bool memory; // benchmarks on an in-memory device
+   int latency; // injected IO latency for in-memory benchmarks
+   bool async; // registry and lists through AsyncIO
 };
 
 int
@@ -82,10 +92,20 @@ parse(int argc, char **argv, struct options* opt) {
             {"remove", no_argument, 0, 'r'},
             {"print", required_argument, 0, 'p'},
             {"snapshot", required_argument, 0, 's'},
-            {"id", required_argument, 0, 'i'}
+            {"id", required_argument, 0, 'i'},
+            {"bench", required_argument, 0, 'b'},
+            {"populate", no_argument, 0, 'P'},
+            {"hugepages", no_argument, 0, 'H'},
+            {"no-advise", no_argument, 0, 'N'},
+            {"memory", no_argument, 0, 'M'},
+            {"latency", required_argument, 0, 'L'},
+            {"compact", required_argument, 0, 'C'},
+            {"test", no_argument, 0, 'T'},
+            {"async", no_argument, 0, 'A'},
+            {0, 0, 0, 0}
         };
 
-	while ((c = getopt_long(argc, argv, "t:c:d:a:rp:s:i:",
+	while ((c = getopt_long(argc, argv, "t:c:d:a:rp:s:i:b:PHNML:C:TA",
                         long_options, &opt_index)) != -1) {
 
        	    switch(c) {
@@ -119,6 +139,41 @@ parse(int argc, char **argv, struct options* opt) {
        	    case 'i':
                 opt->id = optarg;
                 break;
+       	    case 'b':
+                // benchmark with given number of threads
+                opt->bench = atoi(optarg);
+                break;
+       	    case 'P':
+                // prefault the device at open
+                opt->storage |= STORAGE_POPULATE;
+                break;
+       	    case 'H':
+                // in-memory devices, file mappings get no huge pages
+                opt->storage |= STORAGE_HUGEPAGES;
+                break;
+       	    case 'N':
+                opt->storage &= ~STORAGE_ADVISE;
+                break;
+       	    case 'M':
+                opt->memory = true;
+                break;
+       	    case 'L':
+                // microseconds per IO
+                opt->latency = atoi(optarg);
+                break;
+       	    case 'C':
+                // drop the holes pop_back leaves
+                opt->id = optarg;
+                opt->compact = true;
+                break;
+       	    case 'T':
+                // self tests of the persistent structures
+                opt->test = true;
+                break;
+       	    case 'A':
+                // io_uring, or a thread pool where it is missing
+                opt->async = true;
+                break;
             default:
                 cerr << "Usage : [--create] [--type] type" << endl;
                 return -1;
@@ -130,7 +185,7 @@ parse(int argc, char **argv, struct options* opt) {
 	   return -ENOTSUP;
         }
 
-        if (opt->id == nullptr) {
+        if (opt->id == nullptr && !opt->bench && !opt->test) {
            cout << "Version name not specified " << endl;
 	   return -EINVAL;
         }
@@ -138,42 +193,12 @@ parse(int argc, char **argv, struct options* opt) {
         return 0;
 }
 
-int main(int argc, char **argv) {
-	struct options opt;
-
-        // Note: in case we have string as member
-        // bzero will corrupt the string object
-        bzero((char*)&opt, sizeof(opt));
-
-        if (argc < 3) {
-           cerr << "Usage : [--type] type [--create] [--delete] [-add] [--remove] [--print]" << endl;
-	   return -EINVAL;
-        }
-
-	if (parse(argc, argv, &opt) < 0)
-	   return -EINVAL;
-
-        init_boost_logger();
-
-        BOOST_LOG_TRIVIAL(debug)
-            << " --type " << opt.type
-            << " --create " << opt.create
-            << " --id " << opt.id
-            << " --delete " << opt.clear
-            << " --add " << opt.add
-            << " --remove " << opt.erase
-            << " --key " << opt.key
-            << " --print " << opt.print
-            << " --snapshot " << opt.snapshot;
-
-        // Init Storage Media
-        StorageResource sink(std::string(dbfile), dbsize);
-        boost::shared_ptr<CoreIO> io = boost::shared_ptr<CoreIO>(new CoreIO(sink));
-        boost::shared_ptr<StorageAllocator> allocator =
-            boost::shared_ptr<StorageAllocator>(new StorageAllocator(sink, 0, sink.size()));
-
+// Registry and list operations, with IO for their reads and writes
+template<class IO>
+int Run(struct options& opt, boost::shared_ptr<IO> io,
+        boost::shared_ptr<StorageAllocator> allocator) {
         // Init Registry
-        typedef Registry<CoreIO, StorageAllocator> GlobalReg;
+        typedef Registry<IO, StorageAllocator> GlobalReg;
         auto reg = boost::shared_ptr<GlobalReg>(new GlobalReg(MAX_READ, io, allocator));
 
         size_t key, parent_key;
@@ -199,7 +224,7 @@ int main(int argc, char **argv) {
         switch (type) {
         case db::registryrecord::LIST: {
 
-           typedef PersistentLinkList<int, CoreIO, StorageAllocator> PMemLinkList;
+           typedef PersistentLinkList<int, IO, StorageAllocator> PMemLinkList;
            boost::shared_ptr<PMemLinkList> pList;
 
            if (opt.snapshot)
@@ -220,6 +245,9 @@ int main(int argc, char **argv) {
            if (opt.erase && pList && !snap)
                pList->pop_back();
 
+           if (opt.compact && pList && !snap)
+               pList->compact();
+
            if (opt.print && pList)
                pList->print();
 
@@ -233,3 +261,62 @@ int main(int argc, char **argv) {
 
         return 0;
 }
+
+int main(int argc, char **argv) {
+	struct options opt;
+
+        // Note: in case we have string as member
+        // bzero will corrupt the string object
+        bzero((char*)&opt, sizeof(opt));
+        opt.storage = STORAGE_DEFAULT;
+
+        if (argc < 2) {
+           cerr << "Usage : [--type] type [--create] [--delete] [-add] [--remove] [--print] [--bench] threads [--populate] [--hugepages] [--no-advise] [--memory] [--latency] usecs [--compact] [--test] [--async]" << endl;
+	   return -EINVAL;
+        }
+
+	if (parse(argc, argv, &opt) < 0)
+	   return -EINVAL;
+
+        init_boost_logger();
+
+        BOOST_LOG_TRIVIAL(debug)
+            << " --type " << opt.type
+            << " --create " << opt.create
+            << " --id " << opt.id
+            << " --delete " << opt.clear
+            << " --add " << opt.add
+            << " --remove " << opt.erase
+            << " --key " << opt.key
+            << " --print " << opt.print
+            << " --snapshot " << opt.snapshot
+            << " --compact " << opt.compact
+            << " --async " << opt.async;
+
+        if (opt.test) {
+           TestRegistryMigrate();
+           TestRegistryLog();
+           TestSpaceMap();
+           TestListCompact();
+           TestAsyncIO();
+           return 0;
+        }
+
+        if (opt.bench) {
+           BenchStorageAllocator(opt.bench, 100000, opt.memory);
+           BenchPersistentLinkList(100000, opt.memory, opt.latency);
+           if (!opt.memory)
+              BenchStartup();
+           return 0;
+        }
+
+        // Init Storage Media
+        StorageResource sink(std::string(dbfile), dbsize, opt.storage);
+        boost::shared_ptr<StorageAllocator> allocator =
+            boost::shared_ptr<StorageAllocator>(new StorageAllocator(sink, 0, sink.Length(), slabsize));
+        allocator->SetGrowth(slabsize);
+
+        if (opt.async)
+           return Run(opt, boost::shared_ptr<AsyncIO>(new AsyncIO(sink, dbfile)), allocator);
+        return Run(opt, boost::shared_ptr<MappedIO>(new MappedIO(sink)), allocator);
+}
@@ -0,0 +1,65 @@
+/*-----------------------------------------------------------------------------
+ *
+ *  Copyright(C): 2017
+ *
+ *  In-memory IO backend with injected device latency
+ *
+ * ----------------------------------------------------------------------------*/
+
+#ifndef _MEM_IO_H
+#define _MEM_IO_H
+
+#include <chrono>
+
+#include "storage_allocator.hpp"
+
+// MappedIO over an anonymous StorageResource, which charges a fixed
+// latency per Read, Write and Barrier. With all latencies at 0 it measures
+// the CPU cost of the data structures alone; the latencies model a device
+// on top of that.
+class MemIO : public MappedIO {
+
+    public :
+
+      MemIO(StorageResource& sink, unsigned int read_usecs = 0,
+          unsigned int write_usecs = 0, unsigned int sync_usecs = 0) :
+          MappedIO(sink), _read_usecs(read_usecs), _write_usecs(write_usecs),
+          _sync_usecs(sync_usecs) {}
+
+     void Read(off_t pos, char *buf, size_t size) {
+        Delay(_read_usecs);
+        MappedIO::Read(pos, buf, size);
+     }
+
+     void Write(off_t pos, const char *buf, size_t size) {
+        Delay(_write_usecs);
+        MappedIO::Write(pos, buf, size);
+     }
+
+     // in-place access is charged as a read
+     char* Address(off_t pos, size_t size) {
+        Delay(_read_usecs);
+        return MappedIO::Address(pos, size);
+     }
+
+     void Barrier(void) {
+        Delay(_sync_usecs);
+        MappedIO::Barrier();
+     }
+
+    private :
+
+     // Spin, sleeping is far too coarse for microsecond latencies
+     static void Delay(unsigned int usecs) {
+        if (!usecs)
+           return;
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(usecs);
+        while (std::chrono::steady_clock::now() < until);
+     }
+
+     unsigned int _read_usecs;
+     unsigned int _write_usecs;
+     unsigned int _sync_usecs;
+};
+
+#endif
@@ -0,0 +1,132 @@
+/*-----------------------------------------------------------------------------
+ *
+ *  Copyright(C): 2017
+ *
+ *  Checksummed record framing for on-disk metadata
+ *
+ * ----------------------------------------------------------------------------*/
+
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#define FRAME_SIGNATURE (0x5afec0de)
+// Bounds a garbage length before it reaches the payload checksum
+#define FRAME_MAX_PAYLOAD (64*1024)
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+// it, a byte-wise table otherwise; both give the same result.
+inline uint32_t Crc32cSoft(uint32_t crc, const char *buf, size_t length) {
+    static const struct Table {
+       uint32_t t[256];
+       Table() {
+          for (uint32_t i = 0; i < 256; i++) {
+             uint32_t c = i;
+             for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+             t[i] = c;
+          }
+       }
+    } table;
+    while (length--)
+       crc = table.t[(crc ^ (uint8_t)*buf++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t Crc32cHard(uint32_t crc, const char *buf, size_t length) {
+    uint64_t c = crc;
+    for (; length >= 8; buf+=8, length-=8) {
+       uint64_t v;
+       memcpy(&v, buf, sizeof(v));
+       c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = c;
+    while (length--)
+       crc = __builtin_ia32_crc32qi(crc, *buf++);
+    return crc;
+}
+#endif
+
+inline uint32_t Crc32c(const char *buf, size_t length, uint32_t crc = 0) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool hard = __builtin_cpu_supports("sse4.2");
+    if (hard)
+       return ~Crc32cHard(crc, buf, length);
+#endif
+    return ~Crc32cSoft(crc, buf, length);
+}
+
+// A frame is a 16-byte header followed by the payload. The checksum
+// covers the length and the payload, so a torn or stale frame fails to
+// decode instead of being parsed. A non-zero seed ties the frame to its
+// owner, it only decodes with the seed it was encoded with.
+class RecordFrame {
+
+    public:
+
+       struct Header {
+          uint32_t magic;
+          uint32_t crc;
+          uint64_t length; // payload bytes
+       };
+
+       static size_t Length(size_t payload) {
+          return sizeof(Header) + payload;
+       }
+
+       // Frame written into a caller buffer of Length(length) bytes
+       static void Encode(char *out, const char *payload, size_t length,
+          uint32_t seed = 0) {
+          Header hdr;
+          hdr.magic = FRAME_SIGNATURE;
+          hdr.length = length;
+          hdr.crc = Checksum(hdr.length, payload, seed);
+          memcpy(out, &hdr, sizeof(hdr));
+          memcpy(out + sizeof(hdr), payload, length);
+       }
+
+       static void Encode(std::string &out, const std::string& payload) {
+          const size_t at = out.size();
+          out.resize(at + Length(payload.size()));
+          Encode(&out[at], payload.data(), payload.size());
+       }
+
+       // True if buf starts a frame at all, which may still be corrupt
+       static bool Present(const char *buf) {
+          uint32_t magic;
+          memcpy(&magic, buf, sizeof(magic));
+          return magic == FRAME_SIGNATURE;
+       }
+
+       // Check the frame of at most avail bytes at buf and return its
+       // payload, or null if it is missing, cut short or corrupt
+       static const char* Decode(const char *buf, size_t avail, size_t *length,
+          uint32_t seed = 0) {
+          Header hdr;
+          if (avail < sizeof(hdr))
+             return nullptr;
+          memcpy(&hdr, buf, sizeof(hdr));
+          if (hdr.magic != FRAME_SIGNATURE || hdr.length > FRAME_MAX_PAYLOAD ||
+              hdr.length > avail - sizeof(hdr))
+             return nullptr;
+          const char *payload = buf + sizeof(hdr);
+          if (hdr.crc != Checksum(hdr.length, payload, seed))
+             return nullptr;
+          *length = hdr.length;
+          return payload;
+       }
+
+    private:
+
+       static uint32_t Checksum(uint64_t length, const char *payload, uint32_t seed) {
+          return Crc32c(payload, length, Crc32c((const char*)&length, sizeof(length), seed));
+       }
+};
+
+#endif
@@ -5,7 +5,9 @@
  *  Registry debugrmation of Persistent Data Structures
  *
  * ----------------------------------------------------------------------------*/
-#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
 #include <algorithm>
 
 #include <boost/functional/hash.hpp>
@@ -19,6 +21,83 @@ using namespace std;
 #define CHECK_HASH(z) (boost::hash_value(z))
 
 #define REGISTRY_SIGNATURE (0xdeadbeef)
+// Entries of version 1 and up frame their data structure records with a
+// checksum, see RecordFrame. Version 0 entries keep bare records. From
+// version 2 on the checksum is seeded with the owner's key and the element
+// count on disk may trail the records, see defer. From version 3 on the
+// records are kept in chained chunks.
+#define REGISTRY_VERSION (3)
+#define REGISTRY_LOG_SIGNATURE (0x1091091)
+// link to the next segment, within the header slot
+#define REGISTRY_LINK_OFFSET (64)
+// Entries are stored as FlatRecord, see below. Entries framed as protobuf
+// or bare protobuf are still read, and rewritten flat by compaction.
+#define REGISTRY_FLAT_SIGNATURE (0xf1a7ec0d)
+#define REGISTRY_FLAT_FORMAT (1)
+// deferred updates are written out after this many, or by the first
+// defer() this long after the oldest one
+#define REGISTRY_DEFER_MAX (1024)
+#define REGISTRY_DEFER_USECS (100*1000)
+
+// Fixed layout of a registry entry, read with one copy and no parsing.
+// The element count is the only field changed in place, with a single
+// 8-byte store, so it is kept out of the checksum.
+struct FlatRecord {
+   uint32_t magic;
+   uint8_t format; // layout version
+   uint8_t type;
+   uint8_t issnap;
+   uint8_t pad;
+   uint64_t version;
+   uint64_t key;
+   uint64_t write_gen;
+   uint64_t pkey;
+   uint64_t phys_curr;
+   uint64_t phys_next;
+   int64_t nr_elements;
+   uint32_t crc; // of the fields before nr_elements
+   uint32_t pad2;
+
+   void Encode(const db::registryrecord& rec) {
+      bzero((char*)this, sizeof(*this));
+      magic = REGISTRY_FLAT_SIGNATURE;
+      format = REGISTRY_FLAT_FORMAT;
+      type = rec.type();
+      issnap = rec.issnap();
+      version = rec.version();
+      key = rec.key();
+      write_gen = rec.write_gen();
+      pkey = rec.pkey();
+      phys_curr = rec.phys_curr();
+      phys_next = rec.phys_next();
+      nr_elements = rec.nr_elements();
+      crc = Checksum();
+   }
+
+   // False if the record is torn, corrupt or of an unknown layout
+   bool Decode(db::registryrecord& rec) const {
+      if (magic != REGISTRY_FLAT_SIGNATURE || format != REGISTRY_FLAT_FORMAT ||
+          crc != Checksum() || !db::registryrecord::PersistenceType_IsValid(type))
+         return false;
+      rec.set_magic(REGISTRY_SIGNATURE);
+      rec.set_version(version);
+      rec.set_key(key);
+      rec.set_write_gen(write_gen);
+      rec.set_pkey(pkey);
+      rec.set_phys_curr(phys_curr);
+      rec.set_phys_next(phys_next);
+      rec.set_nr_elements(nr_elements);
+      rec.set_type((db::registryrecord::PersistenceType)type);
+      rec.set_issnap(issnap);
+      return true;
+   }
+
+   uint32_t Checksum(void) const {
+      return Crc32c((const char*)this, offsetof(FlatRecord, nr_elements));
+   }
+};
+
+static_assert(offsetof(FlatRecord, nr_elements) % 8 == 0, "count store not aligned");
 
 template <class IO, class Allocator>
 class Registry {
@@ -38,11 +117,58 @@ class Registry {
        // bump allocator
        off_t cursor;
 
-       // In-Memory Registry
-       std::list<db::registryrecord> reg_list;
-
-       // Data-Structure for book-keeping snapshots
-       std::map<size_t, vector<int>> _map;
+       // The registry is an append-only log : insert, update, snapshot and
+       // remove each append a version of the entry, the last one of a key
+       // wins on replay and a removal is a version with write_gen 0.
+       //
+       // The log is a chain of segments. Its head is one of the two halves
+       // of the region, the one whose header carries the latest epoch. When
+       // the last segment fills up, the log either grows by a segment taken
+       // from the allocator, or, if at least half of it is dead, is
+       // compacted into a new chain headed by the other half.
+       //
+       // A segment header is framed, the link to the next segment follows
+       // it in the same slot and is set with one 8-byte store once the
+       // next segment is durable. A segment only belongs to the chain if
+       // it carries the epoch of the head.
+       //
+       // A region without headers holds a log of an older release which
+       // spans the whole region, see Migrate.
+       struct LogHeader {
+          uint64_t magic;
+          uint64_t epoch;
+          // extent the segment was carved from, none for the halves
+          uint64_t extent;
+          uint64_t length;
+       };
+
+       struct Segment {
+          off_t pos;
+          off_t extent;
+          size_t length;
+       };
+
+       off_t _start;
+       // active segment
+       off_t _base, _limit;
+       uint64_t _epoch;
+       std::vector<Segment> _segments;
+       // last version handed out
+       uint64_t _gen;
+
+       // keys whose in-memory entry is ahead of the log
+       std::unordered_set<uint64_t> _dirty;
+       size_t _deferred;
+       std::chrono::steady_clock::time_point _since;
+
+       typedef std::unordered_map<uint64_t, db::registryrecord> RecordMap;
+
+       // In-Memory Registry, by key
+       RecordMap reg_list;
+
+       // Data-Structure for book-keeping snapshots : parent key to
+       // the keys of its snapshots
+       std::unordered_map<uint64_t, std::vector<uint64_t>> _map;
 
        boost::shared_ptr<IO> _core;
 
@@ -52,49 +178,23 @@ class Registry {
 
        Registry(size_t size,
           boost::shared_ptr<IO> core, boost::shared_ptr<Allocator> alloc) :
-          region_size(size), _core(core), _allocator(alloc) {
-
-          // Search for the Signature
-          const int start = SPACEMAPREGIONSIZE;
-          off_t pos = ROUNDUP(start, alignment);
-          while (pos < start + region_size) {
-              // Fixed an issue where we passed member magic itself in the Read
-              uint64_t val = 0;
-             _core->Read(pos, (char*)&val, sizeof(magic));
-              if (val != REGISTRY_SIGNATURE)
-                  break;
-
-              pos+=sizeof(magic);
-             _core->Read(pos, (char*)&write_size, sizeof(write_size));
-              auto rbuf = new char[write_size];
-              db::registryrecord rec;
-              pos+=sizeof(write_size);
-             _core->Read(pos, rbuf, write_size);
-              //BOOST_LOG_TRIVIAL(debug) << __func__ << ": " << CHECK_HASH(string(rbuf));
-              // Note the String Constructor used.
-              // In case the char pointer contains null characters
-              rec.ParseFromString(std::string(rbuf, write_size));
-              pos+=write_size;
+          region_size(size), _start(SPACEMAPREGIONSIZE), _epoch(0), _gen(0),
+          _deferred(0), _core(core), _allocator(alloc) {
 
-              // Initializing in-memory registry
-              reg_list.push_back(rec);
-
-              cursor = ROUNDUP(pos, alignment);
-              pos = cursor;
-              BOOST_LOG_TRIVIAL(debug) << rec.ShortDebugString();
-              BOOST_LOG_TRIVIAL(debug) << "registry next cursor location" << cursor;
-              delete [] rbuf;
-          }
-
-          if (reg_list.empty()) {
+          if (!Open()) {
               auto ans = _allocator->Allocate(region_size);
               BOOST_LOG_TRIVIAL(debug) << "Initializing Registry at offset : " << ans.first;
-              cursor = ROUNDUP(ans.first, alignment);
+              assert(ans.first == _start);
+              // the region is committed before anything is written to it
+             _allocator->Sync();
+              WriteHeader(_start, 1);
+              Start(_start, 0, 0);
           } else
               populateSnapList();
        }
 
        ~Registry() {
+           flush();
            reg_list.clear();
        }
 
@@ -106,14 +206,11 @@ class Registry {
                return false;
            }
 
-           for (auto &i : reg_list) {
-               BOOST_LOG_TRIVIAL(trace) << __func__ << " id : " << i.key();
-               if (i.key() == id) {
-                   rec = i;
-                   return true;
-               }
-           }
-           return false;
+           auto iter = reg_list.find(id);
+           if (iter == reg_list.end())
+               return false;
+           rec = iter->second;
+           return true;
        }
 
        // Note we have already reserved region from the
@@ -124,90 +221,100 @@ class Registry {
            db::registryrecord rec;
            assert(cursor % alignment == 0);
            rec.set_magic(REGISTRY_SIGNATURE);
-           rec.set_version(0);
+           rec.set_version(REGISTRY_VERSION);
            rec.set_key(id);
            rec.set_issnap(false);
-           rec.set_write_gen(cursor);
            rec.set_pkey(0);
-           rec.set_phys_curr(cursor);
            rec.set_phys_next(0);
            rec.set_nr_elements(0);
            rec.set_type(db::registryrecord::LIST);
 
-           std::string str;
-           rec.SerializeToString(&str);
+           append(rec);
+           reg_list[id] = rec;
            BOOST_LOG_TRIVIAL(debug) << __func__ << ": " << rec.ShortDebugString();
+       }
 
-           //Next position for new entry
-           auto pos = cursor;
-          _core->Write(pos, (char*)&magic, sizeof(magic));
-           pos+=sizeof(magic);
-           write_size = str.size();
-          _core->Write(pos, (char*)&write_size, sizeof(write_size));
-           pos+=sizeof(write_size);
-          _core->Write(pos, str.c_str(), write_size);
-           //BOOST_LOG_TRIVIAL(debug) << __func__ << ": " << CHECK_HASH(str);
-           reg_list.push_back(rec);
-
-           // Update cursor
-           cursor = ROUNDUP(pos, alignment);
-           BOOST_LOG_TRIVIAL(debug) << "registry next cursor location " << cursor;
+       bool reg_lookup(RecordMap::iterator& iter, uint64_t key) {
+           iter = reg_list.find(key);
+           return iter != reg_list.end();
        }
 
-       bool reg_lookup(std::list<db::registryrecord>::iterator&  iter, uint64_t key) {
+       void update(db::registryrecord& rec) {
 
-           if (reg_list.empty())
-               return false;
+           RecordMap::iterator iter;
+           if (!reg_lookup(iter, rec.key()))
+               return;
 
-           for (iter = reg_list.begin();
-               (iter != reg_list.end()) && ((*iter).key() != key) ; iter++);
+           BOOST_LOG_TRIVIAL(debug) << __func__ << ": " << rec.key();
+
+           // a new count alone is stored into the current entry
+           if (Count(iter->second, rec) && store(iter->second, rec.nr_elements())) {
+              _dirty.erase(rec.key());
+               return;
+           }
 
-           return (iter != reg_list.end()) ? true : false;
+           iter->second = rec;
+           append(iter->second);
+          _dirty.erase(rec.key());
        }
 
-       void update(db::registryrecord& rec) {
+       // Like update for a new element count, which is only written by
+       // the next flush. Meant for counters the owner can recover from its
+       // own records. There is no timer : the age is checked here, so an
+       // idle registry holds its counts until flush() or its destructor.
+       void defer(const db::registryrecord& rec) {
 
-           std::list<db::registryrecord>::iterator iter;
+           RecordMap::iterator iter;
            if (!reg_lookup(iter, rec.key()))
                return;
 
-           BOOST_LOG_TRIVIAL(debug) << __func__ << ": " << rec.key();
-
-           *iter = rec;
-           auto pos = (*iter).phys_curr();
+           assert(Count(iter->second, rec));
+           iter->second.set_nr_elements(rec.nr_elements());
+           auto now = std::chrono::steady_clock::now();
+           if (_dirty.empty())
+               _since = now;
+          _dirty.insert(rec.key());
+           if (++_deferred >= REGISTRY_DEFER_MAX ||
+               now - _since >= std::chrono::microseconds(REGISTRY_DEFER_USECS))
+               flush();
+       }
 
-           std::string str;
-           (*iter).SerializeToString(&str);
-           write_size = str.size();
-           pos+=sizeof(magic);
-          _core->Write(pos, (char*)&write_size, sizeof(write_size));
-           pos+=sizeof(write_size);
-          _core->Write(pos, str.c_str(), write_size);
+       // Write out the deferred entries
+       void flush(void) {
+           for (auto key : _dirty) {
+               auto iter = reg_list.find(key);
+               if (iter != reg_list.end() &&
+                   !store(iter->second, iter->second.nr_elements()))
+                   append(iter->second);
+           }
+          _dirty.clear();
+          _deferred = 0;
        }
 
        void remove(size_t id) {
 
-           std::list<db::registryrecord>::iterator iter;
+           RecordMap::iterator iter;
            if (!reg_lookup(iter, id))
                return;
 
            BOOST_LOG_TRIVIAL(debug) << __func__ << ": " << id;
 
-           (*iter).set_phys_next(0);
-           (*iter).set_nr_elements(0);
-           (*iter).set_write_gen(0);
-
-           std::string str;
-           (*iter).SerializeToString(&str);
-
-           auto pos = (*iter).phys_curr();
-           pos+=sizeof(magic);
-
-           //Update only size and record
-           write_size = str.size();
-          _core->Write(pos, (char*)&(write_size), sizeof(write_size));
-           pos+=sizeof(write_size);
-          _core->Write(pos, str.c_str(), write_size);
+           auto &rec = iter->second;
+           rec.set_phys_next(0);
+           rec.set_nr_elements(0);
+           append(rec, true);
+          _dirty.erase(id);
+
+           // drop it from its parent's snapshots
+           if (rec.issnap()) {
+               auto snaps = _map.find(rec.pkey());
+               if (snaps != _map.end()) {
+                   auto &keys = snaps->second;
+                   keys.erase(std::remove(keys.begin(), keys.end(), rec.key()), keys.end());
+                   if (keys.empty())
+                       _map.erase(snaps);
+               }
+           }
 
            //remove from list
            reg_list.erase(iter);
@@ -215,7 +322,7 @@ class Registry {
 
       void snapshot(size_t child_id, size_t parent_id) {
 
-           std::list<db::registryrecord>::iterator iter;
+           RecordMap::iterator iter;
            if (!reg_lookup(iter, parent_id)) {
                BOOST_LOG_TRIVIAL(error) << "Parent for Snapshot not found : " << parent_id;
                return;
@@ -223,46 +330,504 @@ class Registry {
 
            // Create SnapShot Entry
            db::registryrecord rec;
-           assert(cursor % alignment == 0);
            rec.set_magic(REGISTRY_SIGNATURE);
            rec.set_issnap(true);
-           rec.set_version(0);
+           // the snapshot shares the parent's records and their format
+           auto &parent = iter->second;
+           rec.set_version(parent.version());
            rec.set_key(child_id);
-           rec.set_write_gen(cursor);
            // Note : parent key stored here
-           rec.set_pkey((*iter).key());
-           rec.set_phys_next((*iter).phys_next());
-           rec.set_nr_elements((*iter).nr_elements());
-           rec.set_phys_curr(cursor);
+           rec.set_pkey(parent.key());
+           rec.set_phys_next(parent.phys_next());
+           rec.set_nr_elements(parent.nr_elements());
            rec.set_type(db::registryrecord::LIST);
 
-           std::string str;
-           rec.SerializeToString(&str);
+           append(rec);
+           reg_list[child_id] = rec;
+          _map[parent_id].push_back(child_id);
            BOOST_LOG_TRIVIAL(debug) << __func__ << ": " << rec.ShortDebugString();
+      }
+
+      // Rewrite the live entries into a chain headed by the other half
+      // and make it the log. Entries written before the new head is
+      // durable are never replayed, so a crash leaves the old log in charge.
+      void Compact(void) {
+           const size_t half = HalfSize();
+           const off_t target = (_segments.front().pos == _start) ? _start + half : _start;
+           if (!_epoch && cursor > target) {
+               // a log of an older release still covers the other half,
+               // Open moves it before it gets there
+               BOOST_LOG_TRIVIAL(error) << "Registry log too large to compact";
+               throw std::bad_alloc();
+           }
+
+           // no stale entry of an earlier epoch may follow the live ones
+          _core->Discard(target, half);
+           std::vector<Segment> chain(1, Segment{target, 0, 0});
+           const off_t pos = Rewrite(chain);
+           WriteHeader(target, _epoch + 1);
+          _core->Sync(target, alignment);
+           Switch(chain, pos);
+
+           BOOST_LOG_TRIVIAL(debug) << "Registry compacted " << reg_list.size()
+               << " entries into epoch " << _epoch << " at " << target
+               << ", " << _segments.size() << " segments";
+      }
+
+    private:
+
+      // Write the live entries to chain, whose only segment is cleared,
+      // adding segments as it fills up. The chain is durable on return,
+      // the end of its entries is returned.
+      off_t Rewrite(std::vector<Segment>& chain) {
+           const size_t half = HalfSize();
+           off_t pos = chain.back().pos + alignment;
+           for (auto &i : reg_list) {
+               if (pos + (off_t)alignment > chain.back().pos + (off_t)half) {
+                   auto seg = NewSegment(_epoch + 1);
+                  _core->Sync(chain.back().pos, half);
+                   Link(chain.back().pos, seg.pos);
+                   chain.push_back(seg);
+                   pos = seg.pos + alignment;
+               }
+               i.second.set_phys_curr(pos);
+               const off_t end = pos + save(pos, i.second);
+               pos = ROUNDUP(end, alignment);
+           }
+          _core->Sync(chain.back().pos, pos - chain.back().pos);
+           return pos;
+      }
+
+      // Make chain, whose head is durable, the log of the next epoch
+      void Switch(const std::vector<Segment>& chain, off_t pos) {
+           // the segments of the old chain are garbage now
+           for (auto &seg : _segments)
+               if (seg.length)
+                  _allocator->DeAllocate(seg.extent, seg.length);
+          _segments.clear();
+          _epoch++;
+           for (auto &seg : chain)
+               Start(seg.pos, seg.extent, seg.length);
+           cursor = pos;
+      }
+
+      // Move a log of an older release, which spans the region and has no
+      // header, to a log of epoch 1. One which ends in the first half is
+      // compacted into the second. A longer one is rewritten to segments
+      // of their own, headed by the first half : its header, its link and
+      // a cleared first entry slot go in with one write to one sector, so
+      // the old log is in charge until that write lands.
+      void Migrate(void) {
+           const size_t half = HalfSize();
+           if (cursor <= _start + (off_t)half) {
+               Compact();
+           } else {
+               std::vector<Segment> chain(1, NewSegment(_epoch + 1));
+               const off_t pos = Rewrite(chain);
+
+               std::vector<char> slot(2 * alignment, 0);
+               LogHeader hdr;
+               bzero((char*)&hdr, sizeof(hdr));
+               hdr.magic = REGISTRY_LOG_SIGNATURE;
+               hdr.epoch = _epoch + 1;
+               RecordFrame::Encode(slot.data(), (const char*)&hdr, sizeof(hdr));
+               uint64_t next = chain.front().pos;
+               memcpy(slot.data() + REGISTRY_LINK_OFFSET, &next, sizeof(next));
+              _core->Write(_start, slot.data(), slot.size());
+              _core->Sync(_start, slot.size());
+
+               chain.insert(chain.begin(), Segment{_start, 0, 0});
+               Switch(chain, pos);
+           }
+           BOOST_LOG_TRIVIAL(info) << "Registry log of " << reg_list.size()
+               << " entries migrated to epoch " << _epoch;
+      }
 
-           auto pos = cursor;
-          _core->Write(pos, (char*)&magic, sizeof(magic));
-           pos+=sizeof(magic);
-           write_size = str.size();
-          _core->Write(pos, (char*)&write_size, sizeof(write_size));
-           pos+=sizeof(write_size);
-          _core->Write(pos, str.c_str(), write_size);
+      size_t HalfSize(void) const {
+           return region_size / 2 / alignment * alignment;
+      }
+
+      bool ReadHeader(off_t pos, LogHeader& hdr) {
+           size_t length = 0;
+           auto payload = RecordFrame::Decode(_core->Address(pos, alignment),
+               alignment, &length);
+           // headers of the first release end after the epoch
+           if (!payload || length < offsetof(LogHeader, extent) || length > sizeof(hdr))
+               return false;
+           bzero((char*)&hdr, sizeof(hdr));
+           memcpy(&hdr, payload, length);
+           return hdr.magic == REGISTRY_LOG_SIGNATURE;
+      }
+
+      void WriteHeader(off_t pos, uint64_t epoch, off_t extent = 0, size_t length = 0) {
+           LogHeader hdr;
+           hdr.magic = REGISTRY_LOG_SIGNATURE;
+           hdr.epoch = epoch;
+           hdr.extent = extent;
+           hdr.length = length;
+           char frame[sizeof(RecordFrame::Header) + sizeof(hdr)];
+           static_assert(sizeof(frame) <= REGISTRY_LINK_OFFSET, "header overlaps link");
+           RecordFrame::Encode(frame, (const char*)&hdr, sizeof(hdr));
+          _core->Write(pos, frame, sizeof(frame));
+      }
+
+      off_t Next(off_t pos) {
+           uint64_t next = 0;
+          _core->Read(pos + REGISTRY_LINK_OFFSET, (char*)&next, sizeof(next));
+           return next;
+      }
 
-           reg_list.push_back(rec);
+      void Link(off_t pos, off_t next) {
+           uint64_t val = next;
+          _core->Write(pos + REGISTRY_LINK_OFFSET, (char*)&val, sizeof(val));
+          _core->Sync(pos, alignment);
+      }
+
+      // Make seg the segment entries are appended to
+      void Start(off_t pos, off_t extent, size_t length) {
+          _segments.push_back(Segment{pos, extent, length});
+          _base = pos;
+          _limit = pos + HalfSize();
+           cursor = pos + alignment;
+      }
+
+      // A cleared, aligned segment with its header, not linked yet. Its
+      // extent is committed in the spacemap first.
+      Segment NewSegment(uint64_t epoch) {
+           const size_t half = HalfSize();
+           auto mem = _allocator->Allocate(half + alignment);
+          _allocator->Sync();
+           const off_t pos = (mem.first + alignment - 1) / alignment * alignment;
+          _core->Discard(pos, half);
+           WriteHeader(pos, epoch, mem.first, half + alignment);
+          _core->Sync(pos, alignment);
+           BOOST_LOG_TRIVIAL(debug) << "New registry segment at " << pos;
+           return Segment{pos, mem.first, half + alignment};
+      }
+
+      // Pick the half of the latest epoch and replay its chain. Returns
+      // false for a region which was never written.
+      bool Open(void) {
+           const size_t half = HalfSize();
+           LogHeader hdr[2];
+           bool valid[2];
+           for (int i = 0; i < 2; i++)
+               valid[i] = ReadHeader(_start + i * half, hdr[i]);
+
+           if (!valid[0] && !valid[1]) {
+               _epoch = 0;
+               _base = _start;
+               _limit = _start + region_size;
+              _segments.push_back(Segment{_start, 0, 0});
+               if (!Scan())
+                   return false;
+               Migrate();
+               return true;
+           }
 
-           // Update cursor
+           int i = (valid[0] && (!valid[1] || hdr[0].epoch > hdr[1].epoch)) ? 0 : 1;
+          _epoch = hdr[i].epoch;
+           off_t pos = _start + i * half;
+           LogHeader seg = hdr[i];
+           do {
+               Start(pos, seg.extent, seg.length);
+               Scan();
+               pos = Next(pos);
+               if (pos && (!ReadHeader(pos, seg) || seg.epoch != _epoch)) {
+                   BOOST_LOG_TRIVIAL(error) << "Bad registry segment at " << pos;
+                   break;
+               }
+           } while (pos);
+           BOOST_LOG_TRIVIAL(debug) << "Registry epoch " << _epoch << " at "
+               << _segments.front().pos << ", " << _segments.size() << " segments";
+           return true;
+      }
+
+      // Replay the active segment with one sequential pass
+      bool Scan(void) {
+          _core->Advise(_base, _limit - _base, MADV_SEQUENTIAL);
+          _core->Advise(_base, _limit - _base, MADV_WILLNEED);
+           bool found = Replay();
+           // entries are looked up by key from now on
+          _core->Advise(_base, _limit - _base, MADV_RANDOM);
+           return found;
+      }
+
+      bool Replay(void) {
+          bool found = false;
+          off_t pos = ROUNDUP(_base, alignment);
+          cursor = pos;
+          while (pos < _limit) {
+              // Each entry owns an aligned slot, the scan ends at the
+              // first slot holding no entry. A corrupt entry, e.g. torn by
+              // a crash, is dropped without losing the ones after.
+              const off_t at = pos;
+              const size_t avail = _limit - pos;
+              const char *slot = _core->Address(pos, avail);
+              db::registryrecord rec;
+              size_t length = 0;
+              bool valid = false;
+              uint32_t sig = 0;
+              memcpy(&sig, slot, sizeof(sig));
+              if (sig == REGISTRY_FLAT_SIGNATURE) {
+                  // read in place, slots are aligned
+                  length = sizeof(FlatRecord);
+                  valid = length <= avail &&
+                      reinterpret_cast<const FlatRecord*>(slot)->Decode(rec);
+              } else if (RecordFrame::Present(slot)) {
+                  // Note : protobuf entries of the log before the flat layout
+                  auto payload = RecordFrame::Decode(slot, avail, &write_size);
+                  length = RecordFrame::Length(write_size);
+                  valid = payload && rec.ParseFromArray(payload, write_size);
+                  if (!payload)
+                      length = sizeof(RecordFrame::Header);
+              } else {
+                  // Note : entries written before framing carry no checksum
+                  uint64_t val = 0;
+                  memcpy(&val, slot, sizeof(magic));
+                  if (val != REGISTRY_SIGNATURE)
+                      break;
+                  memcpy(&write_size, slot + sizeof(magic), sizeof(write_size));
+                  length = sizeof(magic) + sizeof(write_size) + write_size;
+                  // parsed in place, the payload may contain null characters
+                  valid = length <= avail &&
+                      rec.ParseFromArray(slot + sizeof(magic) + sizeof(write_size), write_size);
+              }
+              pos+=length;
+              found = true;
+
+              // Initializing in-memory registry, a later version of a
+              // key supersedes an earlier one
+              if (!valid)
+                  BOOST_LOG_TRIVIAL(error) << "Corrupt registry entry at " << at;
+              else {
+                  _gen = std::max<uint64_t>(_gen, rec.write_gen());
+                  BOOST_LOG_TRIVIAL(debug) << rec.ShortDebugString();
+                  if (!rec.write_gen())
+                      reg_list.erase(rec.key());
+                  else
+                      reg_list[rec.key()].Swap(&rec);
+              }
+
+              cursor = ROUNDUP(pos, alignment);
+              pos = cursor;
+              BOOST_LOG_TRIVIAL(debug) << "registry next cursor location" << cursor;
+          }
+          return found;
+      }
+
+      // Make room at the end of the log : a log that is at least half dead
+      // is compacted, otherwise it grows by a segment
+      void Extend(void) {
+           const size_t capacity = _segments.size() * HalfSize();
+           if (!_epoch || (reg_list.size() + 1) * alignment * 2 <= capacity) {
+               Compact();
+               return;
+           }
+           auto seg = NewSegment(_epoch);
+           Link(_base, seg.pos);
+           Start(seg.pos, seg.extent, seg.length);
+      }
+
+      // Append the next version of rec at the cursor
+      void append(db::registryrecord& rec, bool removed = false) {
+           assert(cursor % alignment == 0);
+           // a compaction may leave the last segment full
+           while (cursor + (off_t)alignment > _limit)
+               Extend();
+           rec.set_write_gen(removed ? 0 : ++_gen);
+           rec.set_phys_curr(cursor);
+           auto pos = cursor + save(cursor, rec);
            cursor = ROUNDUP(pos, alignment);
            BOOST_LOG_TRIVIAL(debug) << "registry next cursor location " << cursor;
       }
 
+      // Write the entry to its slot with one write
+      size_t save(off_t pos, const db::registryrecord& rec) {
+           FlatRecord flat;
+           flat.Encode(rec);
+           static_assert(sizeof(flat) <= 128, "entry exceeds its slot");
+          _core->Write(pos, (const char*)&flat, sizeof(flat));
+           return sizeof(flat);
+      }
+
+      // True if rec differs from cur in the element count at most
+      static bool Count(const db::registryrecord& cur, const db::registryrecord& rec) {
+           return cur.key() == rec.key() && cur.version() == rec.version() &&
+               cur.pkey() == rec.pkey() && cur.phys_next() == rec.phys_next() &&
+               cur.type() == rec.type() && cur.issnap() == rec.issnap();
+      }
+
+      // Set the count of the flat entry at cur.phys_curr() in place.
+      // False for an entry of an older layout, which is appended anew.
+      bool store(db::registryrecord& cur, int64_t nr) {
+           const off_t pos = cur.phys_curr();
+           uint32_t val = 0;
+          _core->Read(pos, (char*)&val, sizeof(val));
+           if (val != REGISTRY_FLAT_SIGNATURE)
+               return false;
+          _core->Write(pos + offsetof(FlatRecord, nr_elements), (const char*)&nr, sizeof(nr));
+           cur.set_nr_elements(nr);
+           return true;
+      }
+
+    public:
+
       void populateSnapList(void) {
          for (auto &i : reg_list)
-             if (i.pkey())
-                 _map[i.pkey()].push_back(i.nr_elements());
+             if (i.second.pkey())
+                 _map[i.second.pkey()].push_back(i.first);
       }
 
+      // Largest element count pinned by a snapshot of id
       int GetSnapElements(size_t id) {
-          return (_map.find(id) != _map.end()) ?
-              *max_element(_map[id].begin(), _map[id].end()) : 0;
+          auto snaps = _map.find(id);
+          if (snaps == _map.end())
+              return 0;
+          int nr = 0;
+          for (auto key : snaps->second) {
+              auto iter = reg_list.find(key);
+              if (iter != reg_list.end())
+                  nr = std::max(nr, (int)iter->second.nr_elements());
+          }
+          return nr;
+      }
+
+      // Keys of the snapshots of id
+      std::vector<uint64_t> GetSnapshots(size_t id) {
+          auto snaps = _map.find(id);
+          if (snaps == _map.end())
+              return std::vector<uint64_t>();
+          return snaps->second;
       }
 };
+
+// A registry region as a release before the log headers left it : ten
+// keys rewritten slots times, each version in a 128-byte slot holding the
+// signature, the length and the bare protobuf entry. Its entries must be
+// found, and new ones kept, across the migration and reopens.
+void TestRegistryMigrate(void) {
+    const size_t size = 64*1024*1024;
+    const size_t region = 64*1024;
+    typedef Registry<MappedIO, StorageAllocator> GlobalReg;
+    for (size_t slots : {40, 400}) {
+       StorageResource sink(size);
+       auto io = boost::shared_ptr<MappedIO>(new MappedIO(sink));
+       auto allocator = boost::shared_ptr<StorageAllocator>(
+           new StorageAllocator(sink, 0, size, size));
+       auto mem = allocator->Allocate(region);
+       allocator->Sync();
+       assert(mem.first == SPACEMAPREGIONSIZE);
+
+       off_t pos = mem.first;
+       for (size_t i = 0; i < slots; i++, pos+=128) {
+          db::registryrecord rec;
+          rec.set_magic(REGISTRY_SIGNATURE);
+          rec.set_version(0);
+          rec.set_key(i % 10 + 1);
+          rec.set_write_gen(i + 1);
+          rec.set_phys_curr(pos);
+          rec.set_phys_next(0);
+          rec.set_nr_elements(i);
+          rec.set_type(db::registryrecord::LIST);
+          rec.set_issnap(false);
+          std::string buf;
+          rec.SerializeToString(&buf);
+          uint64_t magic = REGISTRY_SIGNATURE;
+          size_t length = buf.size();
+          io->Write(pos, (char*)&magic, sizeof(magic));
+          io->Write(pos + sizeof(magic), (char*)&length, sizeof(length));
+          io->Write(pos + sizeof(magic) + sizeof(length), buf.data(), length);
+       }
+
+       const size_t added = 2000;
+       for (int open = 0; open < 2; open++) {
+          GlobalReg reg(region, io, allocator);
+          db::registryrecord rec;
+          for (size_t key = 1; key <= 10; key++) {
+             assert(reg.find(key, rec));
+             // the last version of key was written at slot slots - 10 + key - 1
+             assert((size_t)rec.nr_elements() == slots - 11 + key);
+          }
+          for (size_t key = 100; key < 100 + added; key++) {
+             if (!open)
+                reg.insert(key);
+             assert(reg.find(key, rec));
+          }
+       }
+       std::cout << "registry migration of " << slots << " old entries : ok" << std::endl;
+    }
+}
+
+// Rewrites of a few keys compact the log, more live keys than a half
+// holds chain segments to it, and churn afterwards compacts the chain.
+// Every round reopens the registry and checks what it replayed.
+void TestRegistryLog(void) {
+    const size_t size = 64*1024*1024;
+    const size_t region = 64*1024;
+    typedef Registry<MappedIO, StorageAllocator> GlobalReg;
+    StorageResource sink(size);
+    auto io = boost::shared_ptr<MappedIO>(new MappedIO(sink));
+    auto allocator = boost::shared_ptr<StorageAllocator>(
+        new StorageAllocator(sink, 0, size, size));
+
+    auto check = [&](GlobalReg& reg, size_t round) {
+       db::registryrecord rec;
+       for (size_t key = 1; key <= 50; key++) {
+          assert(reg.find(key, rec));
+          assert((size_t)rec.phys_next() == round);
+       }
+       for (size_t key = 1000; key < 1600 && round > 20; key++)
+          assert(reg.find(key, rec) == (key % 2 == 1));
+       if (round > 20) {
+          assert(reg.find(2000, rec) && rec.issnap() && rec.pkey() == 1);
+          assert(reg.GetSnapshots(1).size() == 1);
+       }
+    };
+
+    size_t round = 0;
+    {
+       GlobalReg reg(region, io, allocator);
+       for (size_t key = 1; key <= 50; key++)
+          reg.insert(key);
+       for (round = 1; round <= 20; round++)
+          for (size_t key = 1; key <= 50; key++) {
+             db::registryrecord rec;
+             assert(reg.find(key, rec));
+             rec.set_phys_next(round);
+             reg.update(rec);
+          }
+       round--;
+    }
+    {
+       GlobalReg reg(region, io, allocator);
+       check(reg, round);
+       for (size_t key = 1000; key < 1600; key++)
+          reg.insert(key);
+       for (size_t key = 1000; key < 1600; key += 2)
+          reg.remove(key);
+       reg.snapshot(2000, 1);
+       round++;
+       for (size_t key = 1; key <= 50; key++) {
+          db::registryrecord rec;
+          assert(reg.find(key, rec));
+          rec.set_phys_next(round);
+          reg.update(rec);
+       }
+    }
+    for (int open = 0; open < 2; open++) {
+       GlobalReg reg(region, io, allocator);
+       check(reg, round);
+       round++;
+       for (size_t i = 0; i < 20; i++)
+          for (size_t key = 1; key <= 50; key++) {
+             db::registryrecord rec;
+             assert(reg.find(key, rec));
+             rec.set_phys_next(round);
+             reg.update(rec);
+          }
+    }
+    GlobalReg reg(region, io, allocator);
+    check(reg, round);
+    std::cout << "registry log reopen, compaction and chaining : ok" << std::endl;
+}
@@ -10,11 +10,20 @@
 #define _STORAGE_RESOURCE_H
 
 #include <iostream>
+#include <chrono>
 #include <list>
 #include <memory>
 #include <string>
 #include <map>
+#include <set>
 #include <sstream>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <boost/intrusive/list.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
@@ -22,7 +31,10 @@
 #include <boost/iostreams/stream.hpp>
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
 #include "meta.pb.h"
+#include "record.hpp"
 
 using namespace boost::iostreams;
 using namespace boost::intrusive;
@@ -32,43 +44,407 @@ using namespace boost::filesystem;
 #define SPACEMAPREGIONSIZE (1024*1024)
 #define METASLAB_SIZE (1024*1024*1024)
 
+#define SPACEMAP_SIGNATURE (0xfeedface)
+#define SPACEMAPHEADERSIZE (4096)
+// condense once the active log is this full (percent)
+#define SPACEMAP_CONDENSE_PCT (75)
+// or once it is this many times larger than its condensed form
+#define SPACEMAP_CONDENSE_RATIO (4)
+#define SPACEMAP_CONDENSE_MIN (64*1024)
+// buffered spacemap records are appended once they reach this size
+#define SPACEMAP_DELTA_SIZE (64*1024)
+// mappings a device can grow into
+#define STORAGE_MAX_SEGMENTS (1024)
+
+// StorageResource configuration
+#define STORAGE_ADVISE (0x1)    // madvise hints per access phase
+#define STORAGE_POPULATE (0x2)  // prefault the mapping at open
+#define STORAGE_HUGEPAGES (0x4) // transparent huge pages, in-memory devices only
+#define STORAGE_DEFAULT (STORAGE_ADVISE)
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ (22)
+#endif
+
 // Boost Iostreams Device
+//
+// The file is mapped as segment 0 at open. Grow extends the file and maps
+// the new range as one more segment, so existing mappings never move and
+// readers of them are never blocked.
 class StorageResource : public boost::iostreams::mapped_file {
 
     public :
 
-       StorageResource(const std::string& filepath, size_type max_length) : mapped_file() {
+       struct Segment {
+          off_t base;
+          size_t length;
+          char *data;
+       };
+
+       StorageResource(const std::string& filepath, size_type max_length,
+          int flags = STORAGE_DEFAULT) : mapped_file(), _flags(flags), _anonymous(false),
+          _nr_segments(0) {
           boost::iostreams::mapped_file_params params(filepath);
           params.flags = boost::iostreams::mapped_file::readwrite;
           params.offset = 0;
           params.length = max_length;
           path p(filepath);
-          params.new_file_size = (exists(p) && is_regular_file(p)) ? 0 : max_length;
+          const bool existing = exists(p) && is_regular_file(p);
+          // a file which has grown before is mapped in full, a shorter one
+          // is extended first, a page past its end would fault
+          if (existing && file_size(p) < max_length)
+             resize_file(p, max_length);
+          if (existing)
+             params.length = std::max<size_t>(max_length, file_size(p));
+          params.new_file_size = existing ? 0 : max_length;
           open(params);
+          // Note : mapped_file hides its descriptor, keep one for fallocate
+          _fd = ::open(filepath.c_str(), O_RDWR);
+
+         _segments.resize(STORAGE_MAX_SEGMENTS);
+         _segments[0].base = 0;
+         _segments[0].length = size();
+         _segments[0].data = data();
+         _nr_segments.store(1, std::memory_order_release);
+          Configure(_segments[0]);
+       }
+
+       // In-memory device backed by anonymous memory, for tests and
+       // benchmarks which should not pay for the filesystem. Its contents
+       // go away with it. Note : there is no file, so no CoreIO stream.
+       explicit StorageResource(size_type length, int flags = STORAGE_DEFAULT) :
+          mapped_file(), _fd(-1), _flags(flags), _anonymous(true), _nr_segments(0) {
+          length = (length + alignment() - 1) / alignment() * alignment();
+          void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+          if (addr == MAP_FAILED)
+             throw std::bad_alloc();
+
+         _segments.resize(STORAGE_MAX_SEGMENTS);
+         _segments[0].base = 0;
+         _segments[0].length = length;
+         _segments[0].data = (char*)addr;
+         _nr_segments.store(1, std::memory_order_release);
+          Configure(_segments[0]);
+       }
+
+      ~StorageResource() {
+          for (size_t i = _anonymous ? 0 : 1; i < _nr_segments.load(); i++)
+             munmap(_segments[i].data, _segments[i].length);
+          if (_fd >= 0)
+             ::close(_fd);
+          close();
+      }
+
+       // Mapped length across all segments
+       size_t Length(void) const {
+          auto &last = _segments[_nr_segments.load(std::memory_order_acquire) - 1];
+          return last.base + last.length;
+       }
+
+       // Extend the file to new_size and map the extension
+       void Grow(size_t new_size) {
+          boost::mutex::scoped_lock lock(_grow_lock);
+          // segments start on a page, for mmap and msync
+          new_size = (new_size + alignment() - 1) / alignment() * alignment();
+          const size_t length = Length();
+          if (new_size <= length)
+             return;
+          auto nr = _nr_segments.load();
+          if (nr == STORAGE_MAX_SEGMENTS || (!_anonymous &&
+              (_fd < 0 || ftruncate(_fd, new_size) < 0))) {
+             BOOST_LOG_TRIVIAL(error) << "Cannot grow storage to " << new_size;
+             throw std::bad_alloc();
+          }
+          void *addr = _anonymous ?
+              mmap(NULL, new_size - length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) :
+              mmap(NULL, new_size - length, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, _fd, length);
+          if (addr == MAP_FAILED) {
+             BOOST_LOG_TRIVIAL(error) << "Cannot map storage extension at " << length;
+             throw std::bad_alloc();
+          }
+         _segments[nr].base = length;
+         _segments[nr].length = new_size - length;
+         _segments[nr].data = (char*)addr;
+          Configure(_segments[nr]);
+         _nr_segments.store(nr + 1, std::memory_order_release);
+          BOOST_LOG_TRIVIAL(info) << "Storage grown to " << new_size;
        }
 
-      ~StorageResource() { close(); }
+       // Segment holding pos, null past the end
+       const Segment* Find(off_t pos) const {
+          auto nr = _nr_segments.load(std::memory_order_acquire);
+          for (size_t i = nr; i-- > 0; ) {
+             if (pos >= _segments[i].base)
+                return (pos < (off_t)(_segments[i].base + _segments[i].length)) ?
+                    &_segments[i] : nullptr;
+          }
+          return nullptr;
+       }
+
+       // Pointer to [pos, pos + length) inside the mapping. The range has
+       // to sit in one segment; the pointer stays valid as long as the
+       // resource, growing never moves a mapping.
+       char* Address(off_t pos, size_t length) const {
+          auto seg = Find(pos);
+          if (!seg || pos + length > seg->base + seg->length)
+             throw std::out_of_range("storage range not mapped");
+          return seg->data + (pos - seg->base);
+       }
+
+       // Copy to or from the mapping, across segments if needed
+       void Copy(off_t pos, char *buf, size_t length, bool write) {
+          while (length) {
+             auto seg = Find(pos);
+             if (!seg)
+                throw std::out_of_range("storage access past end of device");
+             size_t n = std::min<size_t>(length, seg->base + seg->length - pos);
+             char *addr = seg->data + (pos - seg->base);
+             if (write) {
+                memcpy(addr, buf, n);
+                MarkDirty(pos, n);
+             } else
+                memcpy(buf, addr, n);
+             pos+=n;
+             buf+=n;
+             length-=n;
+          }
+       }
+
+       // Access pattern hint for [pos, pos + length) : MADV_SEQUENTIAL and
+       // MADV_WILLNEED ahead of scans, MADV_RANDOM for lookups, and
+       // MADV_NORMAL to undo. Ignored without STORAGE_ADVISE.
+       void Advise(off_t pos, size_t length, int advice) {
+          if (!(_flags & STORAGE_ADVISE))
+             return;
+          const off_t page = alignment();
+          const off_t end = pos + length;
+          pos = pos / page * page;
+          while (pos < end) {
+             auto seg = Find(pos);
+             if (!seg)
+                return;
+             size_t n = std::min<size_t>(end - pos, seg->base + seg->length - pos);
+             madvise(seg->data + (pos - seg->base), n, advice);
+             pos+=n;
+          }
+       }
+
+       // Record a range written through Address, Copy does it on its own
+       void MarkDirty(off_t pos, size_t length) {
+          if (_anonymous)
+             return;
+          const off_t page = alignment();
+          off_t start = pos / page * page;
+          off_t end = (pos + length + page - 1) / page * page;
+
+          boost::mutex::scoped_lock lock(_dirty_lock);
+          // merge with overlapping or adjacent ranges
+          auto it = _dirty.upper_bound(start);
+          if (it != _dirty.begin() && std::prev(it)->second >= start)
+             it--;
+          while (it != _dirty.end() && it->first <= end) {
+             start = std::min(start, it->first);
+             end = std::max(end, it->second);
+             it = _dirty.erase(it);
+          }
+         _dirty[start] = end;
+       }
+
+       // Write [pos, pos + length) back to stable storage, only the
+       // pages it covers are flushed
+       void Sync(off_t pos, size_t length) {
+          if (_anonymous)
+             return;
+          const off_t page = alignment();
+          const off_t end = pos + length;
+          pos = pos / page * page;
+          while (pos < end) {
+             auto seg = Find(pos);
+             if (!seg)
+                return;
+             size_t n = std::min<size_t>(end - pos, seg->base + seg->length - pos);
+             if (msync(seg->data + (pos - seg->base), n, MS_SYNC) < 0)
+                BOOST_LOG_TRIVIAL(error) << "msync failed at " << pos;
+             pos+=n;
+          }
+       }
+
+       // Make every write issued before the call durable. Committers
+       // arriving while a flush runs wait and share the next one, so a
+       // batch of them costs one pass over the dirty ranges.
+       void Barrier(void) {
+          boost::mutex::scoped_lock lock(_commit_lock);
+          const uint64_t ticket = ++_requested;
+          while (_durable < ticket) {
+             if (_flushing) {
+               _committed.wait(lock);
+                continue;
+             }
+            _flushing = true;
+             const uint64_t target = _requested;
+             std::map<off_t, off_t> batch;
+             {
+                boost::mutex::scoped_lock dlock(_dirty_lock);
+                batch.swap(_dirty);
+             }
+             lock.unlock();
+             for (auto &r : batch)
+                Sync(r.first, r.second - r.first);
+             lock.lock();
+            _durable = target;
+            _flushing = false;
+            _committed.notify_all();
+          }
+       }
+
+       // Give the pages behind [pos, pos + length) back to the filesystem.
+       // Whole pages get a hole punched in the file, or are dropped through
+       // the mapping, or zeroed if neither is supported. Partial pages at
+       // either end are zeroed in place.
+       void Discard(off_t pos, size_t length) {
+          while (length) {
+             auto seg = Find(pos);
+             if (!seg)
+                return;
+             size_t n = std::min<size_t>(length, seg->base + seg->length - pos);
+             Discard(seg, pos, n);
+             pos+=n;
+             length-=n;
+          }
+       }
+
+    private:
+
+       // Warm start and huge page options, applied to every new segment.
+       // Populating reads the pages in, as MAP_POPULATE would; it neither
+       // allocates the holes of the file nor dirties anything. Shared file
+       // mappings get no transparent huge pages, the option is for the
+       // anonymous ones.
+       void Configure(const Segment& seg) {
+          if ((_flags & STORAGE_HUGEPAGES) && _anonymous &&
+              madvise(seg.data, seg.length, MADV_HUGEPAGE) < 0)
+             BOOST_LOG_TRIVIAL(info) << "Transparent huge pages not available";
+          // Note : MADV_POPULATE_READ needs Linux 5.14, older kernels
+          // only get read-ahead
+          if ((_flags & STORAGE_POPULATE) &&
+              madvise(seg.data, seg.length, MADV_POPULATE_READ) < 0)
+             madvise(seg.data, seg.length, MADV_WILLNEED);
+       }
+
+       void Discard(const Segment* seg, off_t pos, size_t length) {
+          const off_t page = alignment();
+          const off_t end = pos + length;
+          off_t first = (pos + page - 1) / page * page;
+          off_t last = end / page * page;
+          if (first >= last)
+             first = last = end;
+
+          char *base = seg->data - seg->base;
+          memset(base + pos, 0, first - pos);
+          memset(base + last, 0, end - last);
+          if (first == last)
+             return;
+
+          if (_fd >= 0 && !fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  first, last - first))
+             return;
+          if (!madvise(base + first, last - first, _anonymous ? MADV_DONTNEED : MADV_REMOVE))
+             return;
+          BOOST_LOG_TRIVIAL(debug) << "Hole punching not supported, zeroing " << last - first;
+          memset(base + first, 0, last - first);
+       }
+
+       int _fd;
+       int _flags;
+       bool _anonymous;
+
+       // page-aligned dirty ranges, start to end
+       std::map<off_t, off_t> _dirty;
+       boost::mutex _dirty_lock;
+
+       // group commit, see Barrier
+       uint64_t _requested = 0;
+       uint64_t _durable = 0;
+       bool _flushing = false;
+       boost::mutex _commit_lock;
+       boost::condition_variable _committed;
+
+       // segments are only ever appended, see Grow
+       std::vector<Segment> _segments;
+       std::atomic<size_t> _nr_segments;
+       boost::mutex _grow_lock;
 };
 
-// Boost Iostreams stream
-class CoreIO : public boost::iostreams::stream<boost::iostreams::mapped_file> {
+// Positional IO on the mapping. There is no stream position, so one
+// handle can be shared by any number of threads; callers only have to
+// keep their own ranges apart.
+class MappedIO {
 
     public :
-      CoreIO(mapped_file  source) :
-          boost::iostreams::stream<mapped_file> (source) {}
-
-     ~CoreIO() { flush(); }
+      MappedIO(StorageResource& sink) : _sink(sink) {}
 
      void Read(off_t pos, char *buf, size_t size) {
-        seekg(pos, beg);
-        read(buf, size);
-        //std::cout << "Count : " << gcount() << std::endl;
+        _sink.Copy(pos, buf, size, false);
      }
 
      void Write(off_t pos, const char *buf, size_t size) {
-        seekg(pos, beg);
-        write(buf, size);
+        _sink.Copy(pos, (char*)buf, size, true);
+     }
+
+     // Records are parsed and patched in place through this, see
+     // StorageResource::Address
+     char* Address(off_t pos, size_t size) {
+        return _sink.Address(pos, size);
+     }
+
+     // Drop the contents of a freed range, reads return zeros after
+     void Discard(off_t pos, size_t size) {
+        _sink.Discard(pos, size);
+     }
+
+     // Durability, see StorageResource::Sync and Barrier. Writes made
+     // through Address have to be reported with MarkDirty.
+     void MarkDirty(off_t pos, size_t size) {
+        _sink.MarkDirty(pos, size);
+     }
+
+     void Sync(off_t pos, size_t size) {
+        _sink.Sync(pos, size);
      }
+
+     void Barrier(void) {
+        _sink.Barrier();
+     }
+
+     void Advise(off_t pos, size_t size, int advice) {
+        _sink.Advise(pos, size, advice);
+     }
+
+    protected:
+
+     StorageResource& _sink;
+};
+
+// Boost Iostreams stream, for callers which want the stream interface.
+// Read and Write are the positional ones and leave the stream alone.
+class CoreIO : public boost::iostreams::stream<boost::iostreams::mapped_file>,
+               public MappedIO {
+
+    public :
+      CoreIO(StorageResource& sink) :
+          boost::iostreams::stream<mapped_file> (static_cast<mapped_file&>(sink)),
+          MappedIO(sink) {
+          // the mapping is shared with the sink and every other stream on it
+          set_auto_close(false);
+      }
+
+     ~CoreIO() { flush(); }
+
+     using MappedIO::Read;
+     using MappedIO::Write;
 };
 
 class MappedRegion : public boost::enable_shared_from_this<MappedRegion> {
@@ -118,45 +494,61 @@ class MetaSlab : public MappedRegion {
                     return rc.ShortDebugString();
                 }
 
-               size_t Read(off_t start, boost::shared_ptr<CoreIO>& core) {
+                // on-disk footprint : a checksummed frame, see RecordFrame
+                size_t Length(void) const {
+                    return RecordFrame::Length(rc.ByteSizeLong());
+                }
+
+               // Parsed in place from the mapping, at most avail bytes. A
+               // missing, torn or corrupt record reads as 0 bytes.
+               size_t Read(off_t start, size_t avail, boost::shared_ptr<MappedIO>& core) {
                     off_t pos = start;
-                    size_t length = sizeof(unsigned int);
-                    core->Read(pos, (char*)&magic, length);
+                    if (avail < sizeof(unsigned int) + sizeof(size_t))
+                        return 0;
+                    const char *hdr = core->Address(pos, avail);
+                    if (RecordFrame::Present(hdr)) {
+                        auto payload = RecordFrame::Decode(hdr, avail, &size);
+                        if (!payload || !rc.ParseFromArray(payload, size)) {
+                            BOOST_LOG_TRIVIAL(error) << "Bad Space-Map record at " << pos;
+                            magic = 0;
+                            return 0;
+                        }
+                        magic = FRAME_SIGNATURE;
+                        return RecordFrame::Length(size);
+                    }
+
+                    // Note : records written before framing carry no checksum
+                    memcpy(&magic, hdr, sizeof(unsigned int));
                     if (magic == RECORD_SIGNATURE) {
-                        pos+=length;
-                        length = sizeof(size_t);
-                        core->Read(pos, (char*)&size, length);
-                        BOOST_LOG_TRIVIAL(debug) << pos << ":" << size << ":" << length;
-                        assert(size);
-                        char *buf = new char[size];
-                        pos+=length;
-                        length = size;
-                        core->Read(pos, buf, length);
-                        deserialize(std::string(buf, size));
-                        pos+=length;
-                        delete buf;
+                        memcpy(&size, hdr + sizeof(unsigned int), sizeof(size_t));
+                        pos+=sizeof(unsigned int) + sizeof(size_t);
+                        BOOST_LOG_TRIVIAL(debug) << pos << ":" << size;
+                        if (!size || size > avail - (pos - start) ||
+                            !rc.ParseFromArray(core->Address(pos, size), size)) {
+                            magic = 0;
+                            return 0;
+                        }
+                        pos+=size;
                     } else
                         magic = 0;
 
                     return pos - start;
                 }
 
-                size_t Write(off_t start, boost::shared_ptr<CoreIO>& core) {
-                    off_t pos = start;
-                    size_t length = sizeof(unsigned int);
-                    magic = RECORD_SIGNATURE;
-                    core->Write(pos, (char*)&magic, length);
-                    pos+=length;
-                    length = sizeof(size_t);
+                // Frame the record as it sits in the log
+                void Encode(std::string &out) {
                     std::string buf;
                     serialize(buf);
+                    magic = FRAME_SIGNATURE;
                     size = buf.size();
-                    core->Write(pos, (char*)&size, length);
-                    pos+=length;
-                    length = size;
-                    core->Write(pos, buf.c_str(), length);
-                    pos+=length;
-                    return pos - start;
+                    RecordFrame::Encode(out, buf);
+                }
+
+                size_t Write(off_t start, boost::shared_ptr<MappedIO>& core) {
+                    std::string buf;
+                    Encode(buf);
+                    core->Write(start, buf.c_str(), buf.size());
+                    return buf.size();
                 }
 
                 unsigned int magic;
@@ -165,172 +557,704 @@ class MetaSlab : public MappedRegion {
 
            };
 
-           SpaceMap(off_t start, size_t size) : _start(start), _size(size) {}
+           // Header stamped at the start of the log region. The rest of the
+           // region is split in two halves, only the active one is replayed;
+           // the other one receives the next condensed map.
+           struct Header {
+               uint64_t magic;
+               uint64_t generation; // bumped on every condense
+               uint64_t active;     // index of the active log half
+               uint64_t stale;      // bytes of old records in the other half
+               // summary used to pick a slab without replaying its log
+               uint64_t free;
+               uint64_t largest;
+               uint64_t size;       // slab size, 0 on maps older than this field
+           };
+
+           SpaceMap(off_t start, size_t size) : _start(start), _size(size) {
+               bzero((char*)&_hdr, sizeof(_hdr));
+           }
 
            ~SpaceMap() {
                _free_map.clear();
                _alloc_map.clear();
            }
 
+           size_t LogSize(void) const {
+               return (_size - SPACEMAPHEADERSIZE) / 2;
+           }
+
+           off_t LogStart(uint64_t half) const {
+               return _start + SPACEMAPHEADERSIZE + half * LogSize();
+           }
+
+           // Free tree updates keep the size index in sync
+           void AddFree(const SpaceMapRecord& rec) {
+               RemoveFree(rec.rc.base());
+               _free_map[rec.rc.base()] = rec;
+               _size_map.insert(std::make_pair(rec.rc.size(), rec.rc.base()));
+           }
+
+           void RemoveFree(uint64_t base) {
+               auto it = _free_map.find(base);
+               if (it == _free_map.end())
+                   return;
+               _size_map.erase(std::make_pair(it->second.rc.size(), base));
+               _free_map.erase(it);
+           }
+
+           // Merge a freed extent with its free neighbours. Replay does the
+           // same for every DEALLOCATE record, so the trees come out equal.
+           void Coalesce(uint64_t base) {
+               auto it = _free_map.find(base);
+               if (it == _free_map.end())
+                   return;
+               uint64_t start = base;
+               uint64_t end = base + it->second.rc.size();
+               if (it != _free_map.begin()) {
+                   auto prev = std::prev(it);
+                   if (prev->first + prev->second.rc.size() == start)
+                       start = prev->first;
+               }
+               auto next = std::next(it);
+               if (next != _free_map.end() && next->first == end) {
+                   end+=next->second.rc.size();
+                   RemoveFree(next->first);
+               }
+               if (start == base && end == base + it->second.rc.size())
+                   return;
+               RemoveFree(base);
+               AddFree(SpaceMapRecord(start, end - start, db::spacemaprecord::FREE));
+           }
+
+           size_t Largest(void) const {
+               return _size_map.empty() ? 0 : _size_map.rbegin()->first;
+           }
+
            // in-memory tree for spacemap allocations
            std::map<uint64_t, SpaceMap::SpaceMapRecord> _alloc_map;
            // in-memory tree for spacemap deallocations
            std::map<uint64_t, SpaceMap::SpaceMapRecord> _free_map;
+           // free extents ordered by (size, base)
+           std::set<std::pair<uint64_t, uint64_t>> _size_map;
 
            off_t _start; // space-map log region start
            size_t _size; // space-map log region size
+           Header _hdr;
       };
 
 
-      MetaSlab(off_t start, size_t size, boost::shared_ptr<CoreIO> core) :
+      MetaSlab(off_t start, size_t size, boost::shared_ptr<MappedIO> core) :
           MappedRegion(start, size),
-         _log_size(SPACEMAPREGIONSIZE), _cursor(start), _cachedSize(size), _core(core) {
+         _log_size(SPACEMAPREGIONSIZE), _cursor(start), _cachedSize(0), _maxExtent(0),
+         _loaded(false), _condensed(0), _extents(0), _core(core) {
 
-         _id = _base % _size;
+         _id = _base / _size;
          _spacemap.reset(new SpaceMap(_base, _log_size));
 
-         // Update from on-disk Log
-         while (_cursor < (start + _log_size)) {
-            SpaceMap::SpaceMapRecord rec;
-            auto n = rec.Read(_cursor, _core);
-            BOOST_LOG_TRIVIAL(debug) << "Space-Map record size :" << n;
-            if (0 == n)
-                break;
-            if (rec.rc.alloc() == db::spacemaprecord::ALLOCATE) {
-               _spacemap->_alloc_map[rec.rc.base()] = rec;
-                auto it = _spacemap->_free_map.find(rec.rc.base());
-                if (it != _spacemap->_free_map.end())
-                    _spacemap->_free_map.erase(it);
-               _cachedSize-=rec.rc.size();
-            } else {
-               _spacemap->_free_map[rec.rc.base()] = rec;
-                auto it = _spacemap->_alloc_map.find(rec.rc.base());
-                if (it != _spacemap->_alloc_map.end())
-                    _spacemap->_alloc_map.erase(it);
-                if (rec.rc.alloc() == db::spacemaprecord::DEALLOCATE)
-                   _cachedSize+=rec.rc.size();
-            }
-           _cursor+=n;
-            BOOST_LOG_TRIVIAL(debug) << "On-Disk Space-Map Record " << rec.DebugString();
-         }
-
-         // else Initialize New Map
-         if (_cursor == start) {
-             SpaceMap::SpaceMapRecord rec(_base + _log_size, size, db::spacemaprecord::FREE);
-            _cursor+=rec.Write(_cursor, _core);
-            _spacemap->_free_map[rec.rc.base()] = rec;
-             BOOST_LOG_TRIVIAL(debug) << "Creating Space-Map Record" << rec.DebugString();
-         }
+         // Only the summary is read here, the log is replayed on first use
+         _core->Read(_base, (char*)&_spacemap->_hdr, sizeof(SpaceMap::Header));
+         if (_spacemap->_hdr.magic == SPACEMAP_SIGNATURE) {
+            _cachedSize = _spacemap->_hdr.free;
+            _maxExtent = _spacemap->_hdr.largest;
+         } else if (!Migrate())
+             Initialize();
 
          BOOST_LOG_TRIVIAL(debug) << "MetaSlab Avaliable Space " << _cachedSize;
       }
 
       ~MetaSlab() {
+          Flush();
           _spacemap.reset();
           _core.reset();
       }
 
-      // Get from in-memory tree
-      std::pair<off_t, size_t>Allocate(std::string::size_type size) {
-         for (auto it : _spacemap->_free_map) {
-            if (it.second.rc.size() >= size) {
-               // Create New Allocation Record
-               SpaceMap::SpaceMapRecord rec(it.second.rc.base(), size, db::spacemaprecord::ALLOCATE);
-              _cursor+=rec.Write(_cursor, _core);
-               // Update tree
-              _spacemap->_free_map.erase(rec.rc.base());
-              _spacemap->_alloc_map[rec.rc.base()] = rec;
-               BOOST_LOG_TRIVIAL(debug) << rec.DebugString();
-
-               // Create New DeAllocation record
-               auto new_pos = it.second.rc.base() + size;
-               auto new_size = it.second.rc.size() - size;
-               SpaceMap::SpaceMapRecord new_rec(it.second.rc.base() + size,
-                       it.second.rc.size() - size, db::spacemaprecord::FREE);
-              _cursor+=new_rec.Write(_cursor, _core);
-               // Update tree
-              _spacemap->_free_map[new_pos] = new_rec;
-               BOOST_LOG_TRIVIAL(debug) << new_rec.DebugString();
-
-              _cachedSize-=size;
-               return std::pair<off_t, size_t>(rec.rc.base(), rec.rc.size());
-             }
+      // Replay the spacemap log, once
+      void Load(void) {
+         if (!_loaded)
+             Replay();
+      }
+
+      // Append the buffered records to the log with one write, then
+      // persist the summary. Changes since the last flush are lost on
+      // a crash, the log replays to the state of the previous flush.
+      void Flush(void) {
+         if (_pending.empty())
+             return;
+        _core->Write(_cursor, _pending.c_str(), _pending.size());
+        _cursor+=_pending.size();
+        _pending.clear();
+         SaveSummary();
+      }
+
+      // Selection weight : free space and largest extent count equally,
+      // lower slabs are favoured to keep data close together, and a loaded
+      // slab gets a bonus since it saves a replay
+      uint64_t Weight(unsigned int nr) const {
+         uint64_t weight = _cachedSize / 2 + _maxExtent / 2;
+         weight = weight * (2 * nr - _id) / nr;
+         if (_loaded)
+            weight+=weight / 4;
+         return weight;
+      }
+
+      // Get from in-memory tree. With a hint, the extent holding that
+      // offset or the nearest one after it is tried before first fit.
+      std::pair<off_t, size_t>Allocate(std::string::size_type size, off_t near = 0) {
+         Load();
+         if (_spacemap->Largest() < size) {
+            BOOST_LOG_TRIVIAL(debug) << "MetaSlab " << _id << " has no extent for " << size;
+            throw std::bad_alloc();
+         }
+
+         auto &free_map = _spacemap->_free_map;
+         if (near) {
+            auto it = free_map.upper_bound(near);
+            if (it != free_map.begin()) {
+               auto prev = std::prev(it);
+               if (prev->first + prev->second.rc.size() >= near + size)
+                  return Carve(prev->first, prev->second.rc.size(), near, size);
+            }
+            for (; it != free_map.end(); it++) {
+               if (it->second.rc.size() >= size)
+                  return Carve(it->first, it->second.rc.size(), it->first, size);
+            }
+         }
+
+         for (auto &it : free_map) {
+            if (it.second.rc.size() >= size)
+               return Carve(it.first, it.second.rc.size(), it.first, size);
          }
          BOOST_LOG_TRIVIAL(error) << "SpaceMap First Fit failed to find any entry";
          throw std::bad_alloc();
       }
 
       void DeAllocate(off_t start, size_t size) {
+         Load();
          // Free to in-memory tree
          SpaceMap::SpaceMapRecord rec(start, size, db::spacemaprecord::DEALLOCATE);
+         // Note : a free the log cannot take is leaked, the log and the
+         // tree still agree
+         if (!Reserve(rec.Length())) {
+             BOOST_LOG_TRIVIAL(error) << "Space-Map full, leaking " << start << ":" << size;
+             return;
+         }
          // Update Log
-         _cursor+=rec.Write(_cursor, _core);
+         Append(rec);
          // Update tree
-         _spacemap->_free_map[rec.rc.base()] = rec;
+         _spacemap->AddFree(rec);
+         _spacemap->Coalesce(rec.rc.base());
          _spacemap->_alloc_map.erase(rec.rc.base());
          _cachedSize+=size;
+         _maxExtent = _spacemap->Largest();
           BOOST_LOG_TRIVIAL(debug) << rec.DebugString();
       }
 
+      // Rewrite the free tree as a compact log in the inactive half, then
+      // switch the header over to it. The snapshot is synced before the
+      // header is written, so a crash mid-way replays the previous map.
+      // The tree already holds every buffered record, so those are dropped.
+      // False if the map does not fit, the old log is left as it is.
+      bool Condense(void) {
+         Load();
+         auto next = _spacemap->_hdr.active ^ 1;
+         const off_t start = _spacemap->LogStart(next);
+         const off_t end = start + _spacemap->LogSize();
+
+         std::string snapshot;
+         for (auto &it : _spacemap->_free_map) {
+            SpaceMap::SpaceMapRecord rec(it.second.rc.base(),
+                it.second.rc.size(), db::spacemaprecord::FREE);
+            if (start + (off_t)(snapshot.size() + rec.Length()) > end) {
+               BOOST_LOG_TRIVIAL(error) << "Space-Map too fragmented to condense";
+              _condensed = Tail() - LogStart();
+              _extents = _spacemap->_free_map.size();
+               return false;
+            }
+            rec.Encode(snapshot);
+         }
+         const off_t pos = start + snapshot.size();
+         // Wipe what is left of an older generation, replay stops at our tail
+         if (_spacemap->_hdr.stale > snapshot.size())
+            snapshot.append(_spacemap->_hdr.stale - snapshot.size(), 0);
+        _core->Write(start, snapshot.c_str(), snapshot.size());
+        _core->Sync(start, snapshot.size());
+
+        _spacemap->_hdr.generation++;
+        _spacemap->_hdr.stale = _cursor - LogStart();
+        _spacemap->_hdr.active = next;
+        _core->Write(_base, (char*)&_spacemap->_hdr, sizeof(SpaceMap::Header));
+        _core->Sync(_base, sizeof(SpaceMap::Header));
+         BOOST_LOG_TRIVIAL(debug) << "Space-Map condensed from "
+             << Tail() - _spacemap->LogStart(next ^ 1) << " to " << pos - start
+             << " bytes, generation " << _spacemap->_hdr.generation;
+        _cursor = pos;
+        _pending.clear();
+        _condensed = pos - start;
+        _extents = _spacemap->_free_map.size();
+         return true;
+      }
+
       unsigned int _id;  // meta-slab id
       const size_t _log_size; // log-region reserved for spacemap
       size_t _cachedSize;
+      size_t _maxExtent; // largest free extent
+      bool _loaded; // spacemap replayed
+      size_t _condensed; // log bytes after the last condense, 0 if none
+      size_t _extents; // free extents at the last condense
       off_t _cursor; // cursor for the log region
-      boost::shared_ptr<CoreIO> _core;
+      std::string _pending; // records not yet appended to the log
+      boost::shared_ptr<MappedIO> _core;
       boost::shared_ptr<SpaceMap> _spacemap;
+      // serializes allocator threads working on this slab
+      boost::mutex _lock;
+
+    private:
+
+      // Persist the slab summary, it is only a hint for slab selection
+      // and is refreshed from the tree whenever the slab is loaded
+      void SaveSummary(void) {
+        _maxExtent = _spacemap->Largest();
+        _spacemap->_hdr.free = _cachedSize;
+        _spacemap->_hdr.largest = _maxExtent;
+        _core->Write(_base, (char*)&_spacemap->_hdr, sizeof(SpaceMap::Header));
+      }
+
+      off_t LogStart(void) const {
+         return _spacemap->LogStart(_spacemap->_hdr.active);
+      }
+
+      off_t LogEnd(void) const {
+         return LogStart() + _spacemap->LogSize();
+      }
+
+      // end of the log, buffered records included
+      off_t Tail(void) const {
+         return _cursor + _pending.size();
+      }
+
+      // Carve [at, at + size) out of the free extent [base, base + extent).
+      // Replay removes the free entry an ALLOCATE record starts on, so a
+      // cut in the middle first shrinks the extent to the part before it.
+      // All records are sized first, nothing changes unless the log takes them.
+      std::pair<off_t, size_t> Carve(off_t base, size_t extent, off_t at, size_t size) {
+         SpaceMap::SpaceMapRecord head(base, at - base, db::spacemaprecord::FREE);
+         SpaceMap::SpaceMapRecord rec(at, size, db::spacemaprecord::ALLOCATE);
+         auto new_pos = at + size;
+         auto new_size = base + extent - new_pos;
+         SpaceMap::SpaceMapRecord new_rec(new_pos, new_size, db::spacemaprecord::FREE);
+         if (!Reserve((at > base ? head.Length() : 0) + rec.Length() +
+                      (new_size ? new_rec.Length() : 0)))
+             throw std::bad_alloc();
+
+         if (at > base) {
+            Append(head);
+           _spacemap->AddFree(head);
+            BOOST_LOG_TRIVIAL(debug) << head.DebugString();
+         }
+
+         // Create New Allocation Record
+         Append(rec);
+         // Update tree
+        _spacemap->RemoveFree(at);
+        _spacemap->_alloc_map[at] = rec;
+         BOOST_LOG_TRIVIAL(debug) << rec.DebugString();
+
+         // Create New DeAllocation record
+         // Note : an exact fit leaves no remainder, and an empty one
+         // would shadow the free extent which starts right after it
+         if (new_size) {
+            Append(new_rec);
+            // Update tree
+           _spacemap->AddFree(new_rec);
+            BOOST_LOG_TRIVIAL(debug) << new_rec.DebugString();
+         }
+
+        _cachedSize-=size;
+        _maxExtent = _spacemap->Largest();
+         return std::pair<off_t, size_t>(at, size);
+      }
+
+      // Log has outgrown the free tree it describes. Each condense
+      // encodes the whole tree, so the next one waits for the log to grow
+      // by SPACEMAP_CONDENSE_MIN, or once it is full, for the tree to
+      // shrink by about as much.
+      bool NeedsCondense(size_t length) const {
+         // roughly one small record per free extent once condensed
+         const size_t record = sizeof(unsigned int) + sizeof(size_t) + 16;
+         const size_t extents = _spacemap->_free_map.size();
+         const size_t used = Tail() - LogStart();
+         if (used + length > _spacemap->LogSize())
+             return !_condensed ||
+                 (_extents > extents && (_extents - extents) * record >= SPACEMAP_CONDENSE_MIN);
+         if (used < _condensed + SPACEMAP_CONDENSE_MIN)
+             return false;
+         if (used + length > _spacemap->LogSize() * SPACEMAP_CONDENSE_PCT / 100)
+             return true;
+         const size_t condensed = extents * record;
+         return (used > SPACEMAP_CONDENSE_MIN) &&
+                (used > SPACEMAP_CONDENSE_RATIO * condensed);
+      }
+
+      // Make room for length bytes of records, condensing the log if it
+      // has outgrown the tree. False if the log cannot take them.
+      bool Reserve(size_t length) {
+         if (NeedsCondense(length))
+             Condense();
+         if (Tail() + (off_t)length > LogEnd()) {
+             BOOST_LOG_TRIVIAL(error) << "Space-Map log region full";
+             return false;
+         }
+         return true;
+      }
+
+      // Stage a record in the delta buffer, it reaches the log on Flush.
+      // Room for it was made by Reserve.
+      void Append(SpaceMap::SpaceMapRecord& rec) {
+         rec.Encode(_pending);
+         if (_pending.size() >= SPACEMAP_DELTA_SIZE)
+             Flush();
+      }
+
+      // Update from on-disk Log
+      void Replay(void) {
+         const off_t end = LogEnd();
+         Scan(LogStart(), end);
+
+         // A condensed log carries no allocation records, so account
+         // free space from the tree itself
+        _cachedSize = 0;
+         for (auto &it : _spacemap->_free_map)
+            _cachedSize+=it.second.rc.size();
+
+        _loaded = true;
+         if (NeedsCondense(0))
+             Condense();
+         SaveSummary();
+      }
+
+      // Apply the records of [start, end) to the trees, up to the first
+      // one which does not read. Leaves _cursor at the tail.
+      void Scan(off_t start, off_t end) {
+        _cursor = start;
+        _core->Advise(_cursor, end - _cursor, MADV_SEQUENTIAL);
+        _core->Advise(_cursor, end - _cursor, MADV_WILLNEED);
+         while (_cursor < end) {
+            SpaceMap::SpaceMapRecord rec;
+            auto n = rec.Read(_cursor, end - _cursor, _core);
+            BOOST_LOG_TRIVIAL(debug) << "Space-Map record size :" << n;
+            if (0 == n)
+                break;
+            if (rec.rc.alloc() == db::spacemaprecord::ALLOCATE) {
+               _spacemap->_alloc_map[rec.rc.base()] = rec;
+               _spacemap->RemoveFree(rec.rc.base());
+            } else {
+               _spacemap->AddFree(rec);
+                if (rec.rc.alloc() == db::spacemaprecord::DEALLOCATE)
+                   _spacemap->Coalesce(rec.rc.base());
+                auto it = _spacemap->_alloc_map.find(rec.rc.base());
+                if (it != _spacemap->_alloc_map.end())
+                    _spacemap->_alloc_map.erase(it);
+            }
+           _cursor+=n;
+            BOOST_LOG_TRIVIAL(debug) << "On-Disk Space-Map Record " << rec.DebugString();
+         }
+        _core->Advise(start, end - start, MADV_NORMAL);
+      }
+
+      // Slabs from before the header keep their log at _base, where the
+      // header goes. The log is replayed from there and condensed into
+      // the second half, which it must not reach, then the header lands.
+      // Until then the old log is untouched and a crash redoes this.
+      bool Migrate(void) {
+         uint32_t magic;
+        _core->Read(_base, (char*)&magic, sizeof(magic));
+         if (magic != RECORD_SIGNATURE)
+             return false;
+
+         bzero((char*)&_spacemap->_hdr, sizeof(SpaceMap::Header));
+        _spacemap->_hdr.magic = SPACEMAP_SIGNATURE;
+        _spacemap->_hdr.size = _size;
+         Scan(_base, _base + _log_size);
+         if (_cursor > _spacemap->LogStart(1))
+             throw ("Space-Map log too long to migrate");
+
+         // Note : the old format described the free space past the log
+         // as a whole slab long, it ends with the slab now
+         const off_t end = _base + _size;
+         auto last = _spacemap->_free_map.empty() ? _spacemap->_free_map.end() :
+             std::prev(_spacemap->_free_map.end());
+         if (last != _spacemap->_free_map.end() &&
+             (off_t)(last->first + last->second.rc.size()) > end) {
+             SpaceMap::SpaceMapRecord rec(last->first, end - last->first,
+                 db::spacemaprecord::FREE);
+            _spacemap->AddFree(rec);
+         }
+
+        _cachedSize = 0;
+         for (auto &it : _spacemap->_free_map)
+            _cachedSize+=it.second.rc.size();
+        _maxExtent = _spacemap->Largest();
+        _spacemap->_hdr.free = _cachedSize;
+        _spacemap->_hdr.largest = _maxExtent;
+        _loaded = true;
+         // the first half holds the tail of the old log, see Condense
+        _cursor = std::max<off_t>(_cursor, LogStart());
+         if (!Condense())
+             throw ("Space-Map too fragmented to migrate");
+         BOOST_LOG_TRIVIAL(info) << "Space-Map of slab " << _id << " migrated";
+         return true;
+      }
+
+      // else Initialize New Map
+      void Initialize(void) {
+        _spacemap->_hdr.magic = SPACEMAP_SIGNATURE;
+        _spacemap->_hdr.generation = 0;
+        _spacemap->_hdr.active = 0;
+        _spacemap->_hdr.size = _size;
+        _cursor = LogStart();
+
+         // Note : the log region is carved out of the slab itself
+         SpaceMap::SpaceMapRecord rec(_base + _log_size, _size - _log_size,
+             db::spacemaprecord::FREE);
+        _cursor+=rec.Write(_cursor, _core);
+        _spacemap->AddFree(rec);
+        _cachedSize = rec.rc.size();
+        _loaded = true;
+         // header goes last, a torn init has no header and is redone
+         SaveSummary();
+         BOOST_LOG_TRIVIAL(debug) << "Creating Space-Map Record" << rec.DebugString();
+      }
 };
 
 class StorageAllocator
 {
     private:
 
-        std::list<boost::shared_ptr<MetaSlab>> _mslabs;
+        std::vector<boost::shared_ptr<MetaSlab>> _mslabs;
 
-    public:
-        StorageAllocator(StorageResource& sink, const off_t base, size_t size) {
-           if (size < METASLAB_SIZE)
-               throw ("Invalid File Size");
+        // Metaslab selector : slabs ordered by (weight, id)
+        std::set<std::pair<uint64_t, unsigned int>> _selector;
+        // weight and largest extent each slab is filed under
+        std::vector<std::pair<uint64_t, size_t>> _weights;
+        boost::mutex _selector_lock;
+
+        StorageResource& _sink;
+        // one positional handle shared by all slabs
+        boost::shared_ptr<MappedIO> _io;
+        off_t _base;
+        size_t _slab_size;
+
+        // bytes added per Grow, 0 keeps the device at its initial size
+        size_t _growth;
+        boost::mutex _grow_lock;
+
+        // periodic Sync, see SetSyncInterval
+        boost::shared_ptr<boost::thread> _syncer;
+
+        boost::shared_ptr<MetaSlab> Slab(size_t id) {
+           boost::mutex::scoped_lock lock(_selector_lock);
+           return (id < _mslabs.size()) ? _mslabs[id] : boost::shared_ptr<MetaSlab>();
+        }
+
+        // Map nr slabs past the current last one. They are built outside
+        // the selector lock, which is only taken to publish them.
+        void AddSlabs(size_t nr) {
+           std::vector<boost::shared_ptr<MetaSlab>> slabs;
+           size_t first = Slabs();
+           for (size_t i = first; i < first + nr; i++) {
+              boost::shared_ptr<MetaSlab> slab(new MetaSlab(_base + i*_slab_size, _slab_size, _io));
+              slab->_id = i;
+              slabs.push_back(slab);
+           }
 
-           int nr = size/METASLAB_SIZE;
-           for (int i = 0; i < nr; i++) {
-              boost::shared_ptr<MetaSlab> slab;
-              boost::shared_ptr<CoreIO> core;
-              // Write Stream Per MetaSlab
-              core.reset(new CoreIO(sink));
-              slab.reset(new MetaSlab(base + i*METASLAB_SIZE, METASLAB_SIZE, core));
+           boost::mutex::scoped_lock lock(_selector_lock);
+           for (auto &slab : slabs) {
              _mslabs.push_back(slab);
+             _weights.push_back(std::make_pair(slab->Weight(first + nr), slab->_maxExtent));
+             _selector.insert(std::make_pair(_weights[slab->_id].first, slab->_id));
            }
+        }
+
+        // Grow the device for a request of n bytes which no slab could
+        // serve. nr is the slab count the caller searched, a concurrent
+        // grow past it is enough.
+        bool Grow(size_t n, size_t nr) {
+           if (!_growth || n > _slab_size - SPACEMAPREGIONSIZE)
+              return false;
+           boost::mutex::scoped_lock lock(_grow_lock);
+           if (Slabs() > nr)
+              return true;
+           size_t count = std::max<size_t>(_growth / _slab_size, 1);
+           _sink.Grow(_base + (Slabs() + count) * _slab_size);
+           AddSlabs(count);
+           BOOST_LOG_TRIVIAL(info) << "Total Meta-Slabs " << Slabs();
+           return true;
+        }
+
+        // Refile a slab after its free space changed. Called with the
+        // slab lock held; lock order is always slab then selector.
+        void Reweigh(const boost::shared_ptr<MetaSlab>& slab) {
+           boost::mutex::scoped_lock lock(_selector_lock);
+           auto &w = _weights[slab->_id];
+          _selector.erase(std::make_pair(w.first, slab->_id));
+           w = std::make_pair(slab->Weight(_mslabs.size()), slab->_maxExtent);
+          _selector.insert(std::make_pair(w.first, slab->_id));
+        }
+
+    public:
+        // An existing device keeps the slab size it was created with,
+        // slab_size only applies to a new one
+        StorageAllocator(StorageResource& sink, const off_t base, size_t size,
+            size_t slab_size = METASLAB_SIZE) : _sink(sink), _io(new MappedIO(sink)), _base(base),
+            _slab_size(slab_size), _growth(0) {
+           MetaSlab::SpaceMap::Header hdr;
+           sink.Copy(base, (char*)&hdr, sizeof(hdr), false);
+           uint32_t legacy;
+           memcpy(&legacy, &hdr, sizeof(legacy));
+           if (hdr.magic == SPACEMAP_SIGNATURE)
+              _slab_size = hdr.size ? hdr.size : METASLAB_SIZE;
+           else if (legacy == RECORD_SIGNATURE)
+              // a device from before the header, its log starts at base
+              _slab_size = METASLAB_SIZE;
+           if (size < _slab_size || _slab_size <= SPACEMAPREGIONSIZE)
+               throw ("Invalid File Size");
 
+           AddSlabs(size/_slab_size);
            BOOST_LOG_TRIVIAL(debug) << "Total Meta-Slabs " << _mslabs.size();
         }
 
        ~StorageAllocator() {
+          SetSyncInterval(0);
+          Sync();
           _mslabs.clear();
        }
 
+       // Replay every spacemap now instead of on first use
+       void Load(void) {
+          for (size_t id = 0; id < Slabs(); id++) {
+             auto slab = Slab(id);
+             boost::mutex::scoped_lock lock(slab->_lock);
+             slab->Load();
+          }
+       }
+
+       // Commit the current group : each slab appends its buffered
+       // spacemap records with one write, then one barrier makes them
+       // durable. Allocations and frees made since the previous Sync are
+       // not durable until it returns.
+       void Sync(void) {
+          std::vector<boost::shared_ptr<MetaSlab>> slabs;
+          {
+             boost::mutex::scoped_lock lock(_selector_lock);
+             slabs = _mslabs;
+          }
+          for (auto &slab : slabs) {
+             boost::mutex::scoped_lock lock(slab->_lock);
+             slab->Flush();
+          }
+         _io->Barrier();
+       }
+
+       // Grow the device by increment bytes, rounded to whole slabs,
+       // whenever an allocation does not fit. 0 disables growth.
+       void SetGrowth(size_t increment) {
+         _growth = increment;
+       }
+
+       size_t Slabs(void) {
+          boost::mutex::scoped_lock lock(_selector_lock);
+          return _mslabs.size();
+       }
+
+       // Sync from a background thread every msecs, 0 stops it
+       void SetSyncInterval(unsigned int msecs) {
+          if (_syncer) {
+            _syncer->interrupt();
+            _syncer->join();
+            _syncer.reset();
+          }
+          if (msecs)
+            _syncer.reset(new boost::thread([this, msecs]() {
+               try {
+                  while (1) {
+                     boost::this_thread::sleep(boost::posix_time::milliseconds(msecs));
+                     Sync();
+                  }
+               } catch (boost::thread_interrupted&) {}
+            }));
+       }
+
+       // A hint is the offset of a neighbouring object (previous list
+       // node, sibling page). Its slab is tried first, placing the new
+       // extent at or right after that offset.
        std::pair<off_t, size_t> Allocate(std::string::size_type n, void* hint = 0) {
           BOOST_LOG_TRIVIAL(debug) << __func__ << " request size: " << n;
-          for (auto it : _mslabs) {
-             if (it->_cachedSize > n) {
-                auto result = it->Allocate(n);
-                if (result.second)
+
+          const off_t near = (off_t)(uintptr_t)hint;
+          auto hinted = (hint && near >= _base) ? Slab((near - _base) / _slab_size) :
+              boost::shared_ptr<MetaSlab>();
+          if (hinted) {
+             auto &slab = hinted;
+             boost::mutex::scoped_lock lock(slab->_lock);
+             try {
+                auto result = slab->Allocate(n, near);
+                Reweigh(slab);
+                return result;
+             } catch (std::bad_alloc&) {
+                Reweigh(slab);
+             }
+          }
+
+          // Candidates by weight, only the chosen slab gets loaded
+          std::vector<unsigned int> order;
+          size_t nr;
+          {
+             boost::mutex::scoped_lock lock(_selector_lock);
+             nr = _mslabs.size();
+             for (auto it = _selector.rbegin(); it != _selector.rend(); it++) {
+                if (_weights[it->second].second >= n)
+                   order.push_back(it->second);
+             }
+          }
+
+          // First pass skips slabs busy with another thread, the second
+          // one waits. A stale summary just moves us on to the next slab.
+          for (int pass = 0; pass < 2; pass++) {
+             for (auto id : order) {
+                auto slab = Slab(id);
+                boost::mutex::scoped_lock lock(slab->_lock, boost::defer_lock);
+                if (pass == 0 && !lock.try_lock())
+                   continue;
+                if (pass == 1)
+                   lock.lock();
+                try {
+                   auto result = slab->Allocate(n);
+                   Reweigh(slab);
                    return result;
+                } catch (std::bad_alloc&) {
+                   Reweigh(slab);
                 }
-                assert(0);
+             }
           }
+          if (Grow(n, nr))
+             return Allocate(n);
           BOOST_LOG_TRIVIAL(error) << "Metaslab: No Free region";
           throw std::bad_alloc();
        }
 
        void DeAllocate(off_t start, size_t size) {
           BOOST_LOG_TRIVIAL(debug) << __func__ << " freed size: " << size;
-          for (auto it : _mslabs) {
-              if ((it->_base < start) &&
-                  (it->_base + it->_size) > (start + size)) {
-                  it->DeAllocate(start, size);
-                  break;
-              }
+          if (start < _base) {
+             BOOST_LOG_TRIVIAL(error) << "Invalid free of " << start;
+             return;
           }
+          auto slab = Slab((start - _base) / _slab_size);
+          if (!slab)
+              return;
+          boost::mutex::scoped_lock lock(slab->_lock);
+          slab->DeAllocate(start, size);
+          Reweigh(slab);
        }
 };
 
@@ -345,4 +1269,175 @@ void TestIODevice(void) {
     std::cout << core.tellg() << std::endl;
 }
 
+// Free extents of a slab as (base, size)
+std::map<uint64_t, uint64_t> FreeExtents(MetaSlab& slab) {
+    slab.Load();
+    std::map<uint64_t, uint64_t> extents;
+    for (auto &it : slab._spacemap->_free_map)
+       extents[it.first] = it.second.rc.size();
+    return extents;
+}
+
+// Churn that condenses the spacemap several times, then a reopen which
+// must replay the same free tree. Then a slab log as a release before the
+// header left it, which must migrate and survive a reopen as well.
+void TestSpaceMap(void) {
+    const size_t size = 64*1024*1024;
+    {
+       StorageResource sink(size);
+       auto io = boost::shared_ptr<MappedIO>(new MappedIO(sink));
+       std::map<uint64_t, uint64_t> expected;
+       {
+          MetaSlab slab(0, size, io);
+          unsigned int seed = 1;
+          std::vector<std::pair<off_t, size_t>> extents;
+          for (int i = 0; i < 200000; i++) {
+             if (extents.size() < 4096) {
+                extents.push_back(slab.Allocate(24 + rand_r(&seed) % 4096));
+             } else {
+                auto k = rand_r(&seed) % extents.size();
+                slab.DeAllocate(extents[k].first, extents[k].second);
+                extents[k] = extents.back();
+                extents.pop_back();
+             }
+          }
+          assert(slab._spacemap->_hdr.generation > 1);
+          expected = FreeExtents(slab);
+       }
+       MetaSlab slab(0, size, io);
+       assert(FreeExtents(slab) == expected);
+    }
+
+    {
+       StorageResource sink(size);
+       auto io = boost::shared_ptr<MappedIO>(new MappedIO(sink));
+       const off_t base = SPACEMAPREGIONSIZE;
+       const size_t extent = 4096, nr = 100;
+       off_t pos = 0;
+       auto log = [&](off_t start, size_t length, db::spacemaprecord::RecordType type) {
+          MetaSlab::SpaceMap::SpaceMapRecord rec(start, length, type);
+          std::string buf;
+          rec.serialize(buf);
+          unsigned int magic = RECORD_SIGNATURE;
+          size_t n = buf.size();
+          io->Write(pos, (char*)&magic, sizeof(magic));
+          io->Write(pos + sizeof(magic), (char*)&n, sizeof(n));
+          io->Write(pos + sizeof(magic) + sizeof(n), buf.data(), n);
+          pos+=sizeof(magic) + sizeof(n) + n;
+       };
+       // the old format described the free space past the log a slab long
+       log(base, size, db::spacemaprecord::FREE);
+       for (size_t i = 0; i < nr; i++) {
+          log(base + i * extent, extent, db::spacemaprecord::ALLOCATE);
+          log(base + (i + 1) * extent, size - (i + 1) * extent, db::spacemaprecord::FREE);
+       }
+       std::map<uint64_t, uint64_t> expected;
+       for (size_t i = 0; i < nr; i+=3) {
+          log(base + i * extent, extent, db::spacemaprecord::DEALLOCATE);
+          expected[base + i * extent] = extent;
+       }
+       // the last one freed merges with the free space after it
+       expected.rbegin()->second = size - (nr - 1) * extent - base;
+
+       for (int open = 0; open < 2; open++) {
+          MetaSlab slab(0, size, io);
+          assert(slab._spacemap->_hdr.magic == SPACEMAP_SIGNATURE);
+          assert(FreeExtents(slab) == expected);
+          assert(slab._cachedSize == size - base - (nr - (nr + 2) / 3) * extent);
+       }
+    }
+    std::cout << "spacemap condense, reopen and migration : ok" << std::endl;
+}
+
+// Multi-threaded allocate/free benchmark. Every thread keeps a working
+// set of extents and frees a random one once the set is full.
+// In memory, the device is anonymous memory and no file is involved.
+void BenchStorageAllocator(int nthreads, int nops, bool inmemory = false) {
+    const size_t size = 1024*1024*1024;
+    const size_t slab_size = 64*1024*1024;
+    const std::string file("bench.txt");
+    remove(path(file));
+    {
+       boost::shared_ptr<StorageResource> sink(inmemory ?
+           new StorageResource(size) : new StorageResource(file, size));
+       StorageAllocator allocator(*sink, 0, size, slab_size);
+
+       auto worker = [&allocator, nops](unsigned int seed) {
+          std::vector<std::pair<off_t, size_t>> extents;
+          for (int i = 0; i < nops; i++) {
+             if (extents.size() < 64) {
+                extents.push_back(allocator.Allocate(24 + rand_r(&seed) % 4096));
+             } else {
+                auto k = rand_r(&seed) % extents.size();
+                allocator.DeAllocate(extents[k].first, extents[k].second);
+                extents[k] = extents.back();
+                extents.pop_back();
+             }
+          }
+       };
+
+       auto start = std::chrono::steady_clock::now();
+       boost::thread_group threads;
+       for (int i = 0; i < nthreads; i++)
+          threads.create_thread(boost::bind<void>(worker, i + 1));
+       threads.join_all();
+       allocator.Sync();
+       auto usecs = std::chrono::duration_cast<std::chrono::microseconds>
+           (std::chrono::steady_clock::now() - start).count();
+
+       std::cout << "allocator" << (inmemory ? " (memory): " : ": ") << nthreads << " threads, "
+                 << (size_t)nthreads * nops << " ops in " << usecs << " us ("
+                 << (usecs ? (size_t)nthreads * nops * 1000000 / usecs : 0)
+                 << " ops/sec)" << std::endl;
+    }
+    remove(path(file));
+}
+
+// Cold start of a populated device : map it, read the slab summaries and
+// replay every spacemap, once per storage configuration. The file is
+// dropped from the page cache before each run.
+void BenchStartup(void) {
+    const size_t slab_size = 8*1024*1024;
+    const size_t size = 8*slab_size;
+    const std::string file("startup.txt");
+    remove(path(file));
+    {
+       StorageResource sink(file, size);
+       StorageAllocator allocator(sink, 0, size, slab_size);
+       unsigned int seed = 1;
+       std::vector<std::pair<off_t, size_t>> extents;
+       for (int i = 0; i < 50000; i++) {
+          extents.push_back(allocator.Allocate(24 + rand_r(&seed) % 256));
+          if (i % 2) {
+             auto k = rand_r(&seed) % extents.size();
+             allocator.DeAllocate(extents[k].first, extents[k].second);
+             extents[k] = extents.back();
+             extents.pop_back();
+          }
+       }
+       allocator.Sync();
+    }
+
+    const std::vector<std::pair<int, std::string>> configs = {
+       {0, "no hints"},
+       {STORAGE_ADVISE, "advise"},
+       {STORAGE_ADVISE | STORAGE_POPULATE, "advise + populate"}
+    };
+    for (auto &config : configs) {
+       int fd = ::open(file.c_str(), O_RDWR);
+       fdatasync(fd);
+       posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+       ::close(fd);
+
+       auto start = std::chrono::steady_clock::now();
+       StorageResource sink(file, size, config.first);
+       StorageAllocator allocator(sink, 0, size, slab_size);
+       allocator.Load();
+       auto usecs = std::chrono::duration_cast<std::chrono::microseconds>
+           (std::chrono::steady_clock::now() - start).count();
+       std::cout << "startup: " << config.second << " " << usecs << " us" << std::endl;
+    }
+    remove(path(file));
+}
+
 #endif
@@ -6,11 +6,28 @@
  *
  * ----------------------------------------------------------------------------*/
 #include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <boost/make_shared.hpp>
 
 #include "storage_allocator.hpp"
+#include "mem_io.hpp"
 #include "registry.hpp"
 #include "meta.pb.h"
 
+// nodes decoded per mapped run when replaying a list
+#define LIST_REPLAY_RUN (64*1024)
+
+#define LIST_CHUNK_SIGNATURE (0xc4c4c4c4)
+// nodes per chunk, doubling from the first chunk of a list
+#define LIST_CHUNK_MIN (16)
+#define LIST_CHUNK_MAX (4096)
+
+// pop_back compacts a list of at least this many records past the ones
+// snapshots read, once half of them are dead
+#define LIST_COMPACT_MIN (1024)
+
 template<class T>
 class LinkListNode {
 
@@ -41,6 +58,33 @@ class LinkListNode {
            std::copy(buf, buf + sizeof(struct Data), (char*)&data._value);
         }
 
+        // On-disk footprint : Data in a checksummed frame, or bare Data in
+        // lists whose registry entry predates framing (version 0)
+        static size_t Length(uint64_t version) {
+           return version ? RecordFrame::Length(sizeof(struct Data)) : sizeof(struct Data);
+        }
+
+        // seed identifies the owning list, see PersistentLinkList::Seed
+        void Encode(char *buf, uint64_t version, uint32_t seed = 0) const {
+           if (!version)
+              return serialize(buf, sizeof(struct Data));
+           RecordFrame::Encode(buf, (const char*)&data, sizeof(struct Data), seed);
+        }
+
+        // False if the record is missing, torn, corrupt or of another list
+        bool Decode(const char *buf, uint64_t version, uint32_t seed = 0) {
+           if (!version) {
+              deserialize(buf, sizeof(struct Data));
+              return true;
+           }
+           size_t length = 0;
+           auto payload = RecordFrame::Decode(buf, Length(version), &length, seed);
+           if (!payload || length != sizeof(struct Data))
+              return false;
+           deserialize(payload, length);
+           return true;
+        }
+
         const std::string DebugString(void) const {
            std::ostringstream ss;
            ss << " value: " << data._value ;
@@ -52,38 +96,123 @@ class LinkListNode {
 template<class T, class IO, class Allocator>
 class PersistentLinkList {
 
+    private:
+
+       // Nodes of a version 3 list live in chunks : a header, then node
+       // slots filled in order. Chunks are chained by their header, the
+       // link is set with one 8-byte store once the next chunk is in place.
+       struct ChunkHeader {
+          uint64_t magic;
+          uint64_t nodes; // slots
+          uint64_t next;
+          uint64_t pad;
+       };
+
+       struct Chunk {
+          off_t pos;
+          size_t nodes;
+       };
+
     public:
 
+       // Forward iterator over the records of a list, decoded straight
+       // from the mapping a run at a time, with what follows read ahead.
+       // Holes come back too, with a zero _phys_birth.
        class Iterator {
 
-          boost::shared_ptr<LinkListNode<T>> _curr;
-
           public :
 
-          boost::shared_ptr<LinkListNode<T>> get(void) const {
-             return _curr;
+          // Next record in list order, false past the last one
+          bool Next(LinkListNode<T>& node) {
+             if (_at == _run && !Fill())
+                return false;
+             if (!node.Decode(_buf + _at * _size, _list->preg.version(), _list->Seed())) {
+                _done = true;
+                return false;
+             }
+             _at++;
+             _count++;
+             _used++;
+             return true;
           }
 
-          Iterator Next(boost::shared_ptr<IO> &core) const {
-             const off_t pos = _curr->data._phys_curr + sizeof(_curr->data);
-             auto node =
-                 boost::shared_ptr<LinkListNode<T>>(new LinkListNode<T>());
-             const size_t size = sizeof(node->data);
-             char rbuf[size];
-             core->Read(pos, rbuf, size);
-             node->deserialize(rbuf, size);
-             return Iterator(node);
-          }
-
-          Iterator(boost::shared_ptr<LinkListNode<T>> node) : _curr(node) {}
-
-          Iterator operator=(const Iterator& node) {
-             (*this)._curr = node._curr;
-              return *this;
+          // records read, and those of them in the last chunk
+          size_t count(void) const { return _count; }
+          size_t used(void) const { return _used; }
+
+          // chunks are added to chunks as they are reached
+          Iterator(PersistentLinkList& list, std::vector<Chunk> *chunks = nullptr)
+             : _list(&list), _chunks(chunks),
+               _size(LinkListNode<T>::Length(list.preg.version())),
+               _pos(list.Chunked() ? 0 : list.preg.phys_next()),
+               _next(list.Chunked() ? list.preg.phys_next() : 0),
+               _left(list.Chunked() ? 0 : SIZE_MAX),
+               _buf(nullptr), _at(0), _run(0), _count(0), _used(0),
+               _done(!list.preg.phys_next()) {}
+
+          private :
+
+          // Map the next run, from the next chunk once this one is read.
+          // A count which may trail the records only bounds the scan from
+          // below, it goes on while the records which follow are ours.
+          bool Fill(void) {
+             const size_t nr = _list->preg.nr_elements();
+             const bool trailing = _list->Trailing();
+             if (_done || (_count >= nr && !trailing))
+                return false;
+             while (!_left) {
+                ChunkHeader hdr;
+                if (_next)
+                  _list->_core->Read(_next, (char*)&hdr, sizeof(hdr));
+                if (!_next || hdr.magic != LIST_CHUNK_SIGNATURE || hdr.nodes > LIST_CHUNK_MAX) {
+                   if (_next)
+                      BOOST_LOG_TRIVIAL(error) << "Bad list chunk at " << _next;
+                   _done = true;
+                   return false;
+                }
+                _list->_core->Advise(_next, sizeof(hdr) + hdr.nodes * _size, MADV_WILLNEED);
+                if (_chunks)
+                   _chunks->push_back(Chunk{(off_t)_next, hdr.nodes});
+                _pos = _next + sizeof(hdr);
+                _left = hdr.nodes;
+                _next = hdr.next;
+                _used = 0;
+             }
+             size_t run = std::min<size_t>(LIST_REPLAY_RUN, _left);
+             if (_count < nr && !trailing)
+                run = std::min<size_t>(run, nr - _count);
+             _buf = _list->Map(_pos, run, _size);
+             if (!_buf) {
+                _done = true;
+                return false;
+             }
+             // nodes of older lists follow each other, fetch the next run
+             if (!_list->Chunked())
+                _list->_core->Advise(_pos, 2 * run * _size, MADV_WILLNEED);
+             _pos+=run * _size;
+             if (_left != SIZE_MAX)
+                _left-=run;
+             _at = 0;
+             _run = run;
+             return true;
           }
 
+          PersistentLinkList *_list;
+          std::vector<Chunk> *_chunks;
+          const size_t _size;
+          off_t _pos;     // next run
+          uint64_t _next; // next chunk
+          size_t _left;   // slots left in the chunk
+          const char *_buf;
+          size_t _at, _run;
+          size_t _count, _used;
+          bool _done;
        };
 
+       Iterator begin(void) {
+           return Iterator(*this);
+       }
+
        void BuildList(void) {
 
            if (0 == preg.phys_next()) {
@@ -91,55 +220,99 @@ class PersistentLinkList {
               return;
            }
 
-           // Create Head
-          _head.reset(new LinkListNode<T>());
-           const size_t size = sizeof(_head->data);
-           char rbuf[size];
-          _core->Read(preg.phys_next(), rbuf, size);
-          _head->deserialize(rbuf, size);
-
-           // Next populate all entries
-           size_t count = 0;
-           Iterator it(_head);
-           do {
-               auto node = it.get();
+           const size_t nr = preg.nr_elements();
+          _list.reserve(nr);
+           // value and position of every node, for the live index
+           std::vector<std::pair<T, size_t>> index;
+           index.reserve(nr);
+
+           Iterator it(*this, &_chunks);
+           auto node = boost::make_shared<LinkListNode<T>>();
+           while (it.Next(*node)) {
+               index.push_back(std::make_pair(node->data._value, _list.size()));
               _list.push_back(node);
+               node = boost::make_shared<LinkListNode<T>>();
+           }
+          _used = it.used();
+
+           if (_list.size() < nr) {
+               // keep the valid prefix, the registry follows on the
+               // next update
+               BOOST_LOG_TRIVIAL(error) << "Bad list record after " << _list.size()
+                   << " of " << nr << " elements";
+               preg.set_nr_elements(_list.size());
+           } else if (_list.size() > nr) {
+               BOOST_LOG_TRIVIAL(debug) << "Recovered " << _list.size() - nr
+                   << " elements past the registry count";
+               preg.set_nr_elements(_list.size());
+           }
+           if (!_list.empty())
+              _head = _list.front();
+
+           // The last node of a value decides if it is live. Sorted, the
+           // index fills the map in order, without a search per node.
+           std::stable_sort(index.begin(), index.end(),
+               [](const std::pair<T, size_t>& a, const std::pair<T, size_t>& b) {
+                   return a.first < b.first;
+               });
+           for (size_t i = 0; i < index.size(); i++) {
+               if (i + 1 < index.size() && !(index[i].first < index[i + 1].first))
+                   continue;
+               auto &node = _list[index[i].second];
                if (node->data._phys_birth)
-                   _map[node->data._value] = node;
-               else {
-                   assert(_map.find(node->data._value) != _map.end());
-                   _map.erase(node->data._value);
-               }
-               BOOST_LOG_TRIVIAL(debug) << "node entry: " << node->DebugString();
-               count++;
-               if (count == preg.nr_elements())
-                   break;
-               it = it.Next(_core);
-           } while (1);
+                  _map.emplace_hint(_map.end(), index[i].first, node);
+           }
+       }
+
+       // Point query, a lazily opened list is read in on the first one
+       bool contains(const T& x) {
+           Build();
+           return _map.find(x) != _map.end();
        }
 
        void push_back(const T& x, bool hole=false) {
 
+           Build();
+
            // Allocate Node
            auto node =
                boost::shared_ptr<LinkListNode<T>> (new LinkListNode<T>(x));
-           const size_t size = sizeof(node->data);
-           char pbuf[size];
-
-           auto mem = _allocator->Allocate(size);
+           const size_t size = LinkListNode<T>::Length(preg.version());
+           std::vector<char> pbuf(size);
+
+           std::pair<off_t, size_t> mem;
+           if (Chunked()) {
+               // bump the tail chunk
+               if (_chunks.empty() || _used == _chunks.back().nodes)
+                   NewChunk();
+               mem.first = _chunks.back().pos + sizeof(ChunkHeader) + _used++ * size;
+           } else {
+               // Ask for the spot right behind the tail, lists of older
+               // versions expect nodes to follow each other
+               void *hint = _list.empty() ? 0 :
+                   (void*)(uintptr_t)(_list.back()->data._phys_curr + size);
+               mem = _allocator->Allocate(size, hint);
+              _allocator->Sync();
+           }
            node->data._phys_curr = mem.first;
            if (hole)
                node->data._phys_birth = 0;
            else
                node->data._phys_birth = mem.first;
-           node->serialize(pbuf, size);
-          _core->Write(node->data._phys_curr, pbuf, size);
+           node->Encode(pbuf.data(), preg.version(), Seed());
+          _core->Write(node->data._phys_curr, pbuf.data(), size);
 
-           if(_list.empty())
-              preg.set_phys_next(node->data._phys_curr);
+           // The count is recovered from the records by BuildList, only
+           // a new head has to reach the registry right away
            auto nr = preg.nr_elements();
            preg.set_nr_elements(nr + 1);
-          _greg->update(preg);
+           if(_list.empty()) {
+              preg.set_phys_next(Chunked() ? _chunks.front().pos : node->data._phys_curr);
+             _greg->update(preg);
+           } else if (Trailing())
+             _greg->defer(preg);
+           else
+             _greg->update(preg);
 
           _list.push_back(node);
           _map[node->data._value] = node;
@@ -147,8 +320,59 @@ class PersistentLinkList {
            BOOST_LOG_TRIVIAL(debug) << "node pushed: " << node->DebugString();
        }
 
+       // push_back of a range of values, with one write per chunk filled
+       // and one registry update for the batch
+       template <class InputIt>
+       void append(InputIt first, InputIt last) {
+
+           Build();
+           if (!Chunked()) {
+               for (; first != last; first++)
+                   push_back(*first);
+               return;
+           }
+
+           std::vector<boost::shared_ptr<LinkListNode<T>>> nodes;
+           for (; first != last; first++)
+               nodes.push_back(boost::make_shared<LinkListNode<T>>(*first));
+           const size_t n = nodes.size();
+           if (!n)
+               return;
+           const bool empty = _list.empty();
+           Place(nodes, false);
+
+           preg.set_nr_elements(preg.nr_elements() + n);
+           if (empty) {
+              preg.set_phys_next(_chunks.front().pos);
+             _greg->update(preg);
+           } else if (Trailing())
+             _greg->defer(preg);
+           else
+             _greg->update(preg);
+
+           // Sorted, the batch goes into the index with exact hints. The
+           // last node of a value wins, as with push_back.
+           std::vector<size_t> order(n);
+           for (size_t i = 0; i < n; i++)
+               order[i] = _list.size() - n + i;
+           std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+               return _list[a]->data._value < _list[b]->data._value;
+           });
+           auto hint = _map.begin();
+           for (size_t i = 0; i < n; i++) {
+               auto &node = _list[order[i]];
+               if (i + 1 < n && !(node->data._value < _list[order[i + 1]]->data._value))
+                   continue;
+               hint = _map.emplace_hint(hint, node->data._value, node);
+               hint->second = node;
+               hint++;
+           }
+           BOOST_LOG_TRIVIAL(debug) << "nodes appended: " << n;
+       }
+
        void pop_back(void) {
 
+           Build();
            if (_list.empty()) {
               BOOST_LOG_TRIVIAL(error) << __func__ << " List is empty!";
               return;
@@ -157,7 +381,7 @@ class PersistentLinkList {
            int snapitems = _greg->GetSnapElements(preg.key());
            BOOST_LOG_TRIVIAL(debug) << "Snap items : " << snapitems;
 
-           typename std::list<boost::shared_ptr<LinkListNode<T>>>::iterator iter = _list.begin();
+           auto iter = _list.begin();
            for (int i = 0; i < snapitems - 1; i++) { if (iter != _list.end()) iter++; }
            BOOST_LOG_TRIVIAL(debug) << "Max item : " << (*iter)->DebugString();
 
@@ -168,8 +392,12 @@ class PersistentLinkList {
                   break;
               } else if (((*riter)->data._phys_birth > 0) &&
                  (_map.find((*riter)->data._value) != _map.end())) {
-                  push_back((*riter)->data._value, true);
-                 _map.erase((*riter)->data._value);
+                  // push_back moves the nodes
+                  const T value = (*riter)->data._value;
+                  push_back(value, true);
+                 _map.erase(value);
+                  if (Sparse(snapitems))
+                     compact();
                   break;
               }
            }
@@ -187,18 +415,8 @@ class PersistentLinkList {
               return;
           }
 
-          // Compute Region Size to Free;
-          const size_t size = sizeof(_head->data);
-          const size_t total_size = preg.nr_elements() * size;
-
-          // Punch Holes to Clear Region
-          char *zeroregion = new char [total_size];
-         _core->Write(preg.phys_next(), zeroregion, total_size);
-          delete zeroregion;
-
-          // Free the Region
-         _allocator->DeAllocate(preg.phys_next(), total_size);
-
+          const size_t total_size = Release(preg.phys_next(), preg.nr_elements());
+         _chunks.clear();
          _head.reset();
 
           // Finally Purge the List
@@ -209,7 +427,78 @@ class PersistentLinkList {
          _greg->remove(preg.key());
        }
 
-       void print(void) const {
+       // Rewrite the list without the records nothing reads any more :
+       // holes, and nodes a later node of their value covers. Records
+       // snapshots read are copied as they are, and the snapshots follow
+       // the list. The registry moves to the new records once they are
+       // durable, the old ones are freed once the move is.
+       void compact(void) {
+
+           Build();
+           if (_list.empty())
+              return;
+
+           const size_t pinned = std::min<size_t>(_list.size(),
+               _greg->GetSnapElements(preg.key()));
+           std::set<T> masked;
+           for (size_t i = 0; i < pinned; i++)
+               masked.insert(_list[i]->data._value);
+
+           // The last node of each value past the pinned ones, if it is
+           // live or a hole over a value snapshots see
+           std::vector<boost::shared_ptr<LinkListNode<T>>> tail;
+           std::set<T> seen;
+           for (size_t i = _list.size(); i-- > pinned; ) {
+               auto &node = _list[i];
+               if (!seen.insert(node->data._value).second)
+                   continue;
+               if (node->data._phys_birth || masked.count(node->data._value))
+                   tail.push_back(boost::make_shared<LinkListNode<T>>(*node));
+           }
+           if (pinned + tail.size() == _list.size())
+              return;
+           std::vector<boost::shared_ptr<LinkListNode<T>>> keep;
+           for (size_t i = 0; i < pinned; i++)
+               keep.push_back(boost::make_shared<LinkListNode<T>>(*_list[i]));
+           keep.insert(keep.end(), tail.rbegin(), tail.rend());
+
+           const off_t old = preg.phys_next();
+           const size_t nr = _list.size();
+          _list.clear();
+          _chunks.clear();
+          _used = 0;
+           Place(keep, true);
+          _core->Barrier();
+
+           preg.set_phys_next(Chunked() ? _chunks.front().pos : _list.front()->data._phys_curr);
+           preg.set_nr_elements(_list.size());
+          _greg->update(preg);
+           for (auto key : _greg->GetSnapshots(preg.key())) {
+               db::registryrecord snap;
+               if (!_greg->find(key, snap))
+                   continue;
+               snap.set_phys_next(preg.phys_next());
+              _greg->update(snap);
+           }
+           // nothing may point to the old records once they are punched out
+          _core->Barrier();
+           Release(old, nr);
+
+          _head = _list.front();
+          _map.clear();
+           for (auto &node : _list) {
+               if (node->data._phys_birth)
+                  _map[node->data._value] = node;
+               else
+                  _map.erase(node->data._value);
+           }
+          _compacted = _list.size();
+           BOOST_LOG_TRIVIAL(debug) << "List compacted from " << nr << " to "
+               << _list.size() << " records";
+       }
+
+       void print(void) {
+          Build();
           BOOST_LOG_TRIVIAL(info) << "------Linked List Dump--------";
           for (auto &i : _map)
                 std::cout << i.second->DebugString() << std::endl;
@@ -217,8 +506,10 @@ class PersistentLinkList {
 
        PersistentLinkList(std::string id,
            boost::shared_ptr<Registry<IO, Allocator>> reg,
-           boost::shared_ptr<IO> core, boost::shared_ptr<Allocator> alloc)
-           : _core(core), _allocator(alloc), _greg(reg) {
+           boost::shared_ptr<IO> core, boost::shared_ptr<Allocator> alloc,
+           bool lazy = false)
+           : _core(core), _allocator(alloc), _greg(reg), _used(0), _built(false),
+             _compacted(0) {
 
            auto key = boost::hash_value(id);
            if (!_greg->find(key, preg)) {
@@ -229,12 +520,165 @@ class PersistentLinkList {
               BOOST_LOG_TRIVIAL(debug) << "Registry record found " << preg.ShortDebugString();
            }
 
-           if (preg.nr_elements()) {
+           // A lazy list keeps the registry record alone until it is
+           // changed or queried, Iterator reads it as it is
+           if (!lazy)
+              Build();
+       }
+
+    private:
+
+       void Build(void) {
+           if (_built)
+              return;
+          _built = true;
+           if (preg.nr_elements())
               BuildList();
+       }
+
+       bool Chunked(void) const {
+           return preg.version() >= 3;
+       }
+
+       // Reserve the next chunk, twice the size of the last one or large
+       // enough for want nodes, and link it behind the tail. The extent is
+       // committed in the spacemap before anything points to it.
+       void NewChunk(size_t want = 0) {
+           const size_t size = LinkListNode<T>::Length(preg.version());
+           const size_t nodes = std::min<size_t>(LIST_CHUNK_MAX, std::max<size_t>(want,
+               _chunks.empty() ? LIST_CHUNK_MIN : _chunks.back().nodes * 2));
+           const size_t bytes = sizeof(ChunkHeader) + nodes * size;
+           auto mem = _allocator->Allocate(bytes);
+          _allocator->Sync();
+
+           // no stale record may follow the last node
+          _core->Discard(mem.first, bytes);
+           ChunkHeader hdr;
+           bzero((char*)&hdr, sizeof(hdr));
+           hdr.magic = LIST_CHUNK_SIGNATURE;
+           hdr.nodes = nodes;
+          _core->Write(mem.first, (char*)&hdr, sizeof(hdr));
+
+           if (!_chunks.empty()) {
+               uint64_t next = mem.first;
+              _core->Write(_chunks.back().pos + offsetof(ChunkHeader, next),
+                   (char*)&next, sizeof(next));
            }
+          _chunks.push_back(Chunk{mem.first, nodes});
+          _used = 0;
+           BOOST_LOG_TRIVIAL(debug) << "New list chunk " << mem.first << " nodes " << nodes;
        }
 
-    private:
+       // Write nodes behind the tail and add them to the in-memory copy.
+       // Chunked lists get one write per chunk filled, older ones a single
+       // extent for all of them. Its end is cleared so that a scan past the
+       // count stops there, and freed again for the next push_back. keep
+       // leaves holes in place.
+       void Place(std::vector<boost::shared_ptr<LinkListNode<T>>>& nodes, bool keep) {
+           const size_t size = LinkListNode<T>::Length(preg.version());
+           const size_t n = nodes.size();
+
+           std::vector<char> buf;
+           if (!Chunked()) {
+               const size_t bytes = (n + 1) * size;
+               auto mem = _allocator->Allocate(bytes);
+              _core->Discard(mem.first, bytes);
+              _allocator->DeAllocate(mem.first + n * size, size);
+              _allocator->Sync();
+               buf.resize(n * size);
+               for (size_t i = 0; i < n; i++) {
+                   auto &node = nodes[i];
+                   const bool hole = keep && !node->data._phys_birth;
+                   node->data._phys_curr = mem.first + i * size;
+                   node->data._phys_birth = hole ? 0 : node->data._phys_curr;
+                   node->Encode(&buf[i * size], preg.version(), Seed());
+                  _list.push_back(node);
+               }
+              _core->Write(mem.first, buf.data(), buf.size());
+               return;
+           }
+
+           // The free slots of the tail chunk first, then new chunks
+           // sized for the rest
+           for (size_t done = 0; done < n; ) {
+               if (_chunks.empty() || _used == _chunks.back().nodes)
+                   NewChunk(n - done);
+               const size_t run = std::min(n - done, _chunks.back().nodes - _used);
+               const off_t pos = _chunks.back().pos + sizeof(ChunkHeader) + _used * size;
+               buf.resize(run * size);
+               for (size_t i = 0; i < run; i++) {
+                   auto &node = nodes[done + i];
+                   const bool hole = keep && !node->data._phys_birth;
+                   node->data._phys_curr = pos + i * size;
+                   node->data._phys_birth = hole ? 0 : node->data._phys_curr;
+                   node->Encode(&buf[i * size], preg.version(), Seed());
+                  _list.push_back(node);
+               }
+              _core->Write(pos, buf.data(), buf.size());
+              _used+=run;
+               done+=run;
+           }
+       }
+
+       // Punch out and free the records of nr nodes from head, chunk by
+       // chunk or as the one extent of an older list. Returns the bytes.
+       size_t Release(off_t head, size_t nr) {
+           const size_t size = LinkListNode<T>::Length(preg.version());
+           if (!Chunked()) {
+              _core->Discard(head, nr * size);
+              _allocator->DeAllocate(head, nr * size);
+               return nr * size;
+           }
+           size_t total = 0;
+           while (head) {
+               ChunkHeader hdr;
+              _core->Read(head, (char*)&hdr, sizeof(hdr));
+               if (hdr.magic != LIST_CHUNK_SIGNATURE || hdr.nodes > LIST_CHUNK_MAX)
+                   break;
+               const size_t bytes = sizeof(hdr) + hdr.nodes * size;
+              _core->Discard(head, bytes);
+              _allocator->DeAllocate(head, bytes);
+               total+=bytes;
+               head = hdr.next;
+           }
+           return total;
+       }
+
+       // At least half of the records past those snapshots read are
+       // dead, and the list doubled since it was last compacted
+       bool Sparse(size_t pinned) const {
+           const size_t tail = _list.size() - std::min(pinned, _list.size());
+           return tail >= LIST_COMPACT_MIN && 2 * _map.size() <= tail &&
+               _list.size() >= 2 * _compacted;
+       }
+
+       // Map a run of nodes at pos, shortened where the device ends or a
+       // segment boundary falls. Null if not even one node is mapped.
+       const char* Map(off_t pos, size_t& run, size_t size) {
+           while (run) {
+               try {
+                   return _core->Address(pos, run * size);
+               } catch (std::out_of_range&) {
+                   run/=2;
+               }
+           }
+           return nullptr;
+       }
+
+       // Records of a version 2 list carry its key in their checksum, a
+       // snapshot reads those of its parent
+       uint32_t Seed(void) const {
+           if (preg.version() < 2)
+              return 0;
+           uint64_t owner = preg.issnap() ? preg.pkey() : preg.key();
+           return owner ^ (owner >> 32);
+       }
+
+       // The registry count may trail the records, a snapshot keeps the
+       // count it was taken with
+       bool Trailing(void) const {
+           return preg.version() >= 2 && !preg.issnap();
+       }
 
        boost::shared_ptr<IO> _core;
        boost::shared_ptr<Allocator> _allocator;
@@ -249,7 +693,17 @@ class PersistentLinkList {
        boost::shared_ptr<LinkListNode<T>> _head;
 
        // In-memory copy
-       std::list<boost::shared_ptr<LinkListNode<T>>> _list;
+       std::vector<boost::shared_ptr<LinkListNode<T>>> _list;
+
+       // chunks of the list, and slots used in the last one
+       std::vector<Chunk> _chunks;
+       size_t _used;
+
+       // In-memory copy read in
+       bool _built;
+
+       // records left by the last compaction
+       size_t _compacted;
 
        // In-memory copy for live-objects
        std::map<T, boost::shared_ptr<LinkListNode<T>>> _map;
@@ -259,19 +713,20 @@ class PersistentLinkList {
 void TestLinkListNode(void) {
     auto node = boost::shared_ptr<LinkListNode<std::string>>(new LinkListNode<std::string>("Hello"));
     std::cout << node->DebugString() << std::endl;
-    PersistentLinkList<std::string, CoreIO, StorageAllocator>::Iterator it(node);
 }
 
-void TestPersistentLinkList(void) {
+// Runs on an in-memory device unless asked for the list.txt file
+void TestPersistentLinkList(bool inmemory = true) {
     #define DEFAULTKEY "TEST"
     #define MAX_READ (1024*1024)
     size_t size = 1024*1024*1024;
-    StorageResource sink(std::string("log.txt"), size);
-    auto io = boost::shared_ptr<CoreIO>(new CoreIO(sink));;
-    auto allocator = boost::shared_ptr<StorageAllocator>(new StorageAllocator(sink, 0, size));
-    typedef Registry<CoreIO, StorageAllocator> GlobalReg;
+    boost::shared_ptr<StorageResource> sink(inmemory ?
+        new StorageResource(size) : new StorageResource(std::string("list.txt"), size));
+    auto io = boost::shared_ptr<MappedIO>(new MappedIO(*sink));
+    auto allocator = boost::shared_ptr<StorageAllocator>(new StorageAllocator(*sink, 0, size));
+    typedef Registry<MappedIO, StorageAllocator> GlobalReg;
     auto reg = boost::shared_ptr<GlobalReg>(new GlobalReg(MAX_READ, io, allocator));
-    typedef PersistentLinkList<int, CoreIO, StorageAllocator> PMemLinkList;
+    typedef PersistentLinkList<int, MappedIO, StorageAllocator> PMemLinkList;
     auto pList = boost::shared_ptr<PMemLinkList>
         (new PMemLinkList(std::string(DEFAULTKEY), reg, io, allocator));
     pList->push_back(1);
@@ -279,3 +734,118 @@ void TestPersistentLinkList(void) {
     pList->push_back(3);
     pList->pop_back();
 }
+
+// A snapshot pins the first records, rewrites and pops leave dead ones
+// after them. Compaction must keep what the list and its snapshot read,
+// before and after a reopen.
+void TestListCompact(void) {
+    const size_t size = 64*1024*1024;
+    StorageResource sink(size);
+    auto io = boost::shared_ptr<MappedIO>(new MappedIO(sink));
+    auto allocator = boost::shared_ptr<StorageAllocator>(
+        new StorageAllocator(sink, 0, size, size));
+    typedef Registry<MappedIO, StorageAllocator> GlobalReg;
+    typedef PersistentLinkList<int, MappedIO, StorageAllocator> PMemLinkList;
+
+    auto records = [](PMemLinkList& list) {
+       LinkListNode<int> node;
+       size_t nr = 0;
+       for (auto it = list.begin(); it.Next(node); )
+          nr++;
+       return nr;
+    };
+    auto check = [&](boost::shared_ptr<GlobalReg> reg) {
+       PMemLinkList list(std::string("compact"), reg, io, allocator);
+       for (int v = 0; v < 150; v++)
+          assert(list.contains(v) == (v < 140));
+       assert(records(list) == 140);
+       PMemLinkList snap(std::string("compact-snap"), reg, io, allocator);
+       for (int v = 0; v < 150; v++)
+          assert(snap.contains(v) == (v < 100));
+    };
+
+    {
+       auto reg = boost::shared_ptr<GlobalReg>(new GlobalReg(1024*1024, io, allocator));
+       PMemLinkList list(std::string("compact"), reg, io, allocator);
+       for (int v = 0; v < 100; v++)
+          list.push_back(v);
+       reg->snapshot(boost::hash_value(std::string("compact-snap")),
+           boost::hash_value(std::string("compact")));
+       for (int i = 0; i < 10; i++)
+          for (int v = 100; v < 150; v++)
+             list.push_back(v);
+       // holes over 149 down to 140
+       for (int i = 0; i < 10; i++)
+          list.pop_back();
+       list.compact();
+       check(reg);
+    }
+    auto reg = boost::shared_ptr<GlobalReg>(new GlobalReg(1024*1024, io, allocator));
+    check(reg);
+    std::cout << "list compaction under a snapshot : ok" << std::endl;
+}
+
+// Append nops elements to a list, then reopen it. latency is charged by
+// MemIO on every list and registry access, on top of the device.
+void BenchPersistentLinkList(int nops, bool inmemory, unsigned int latency = 0) {
+    const size_t size = 64*1024*1024;
+    const std::string file("bench.txt");
+    remove(path(file));
+    {
+       boost::shared_ptr<StorageResource> sink(inmemory ?
+           new StorageResource(size) : new StorageResource(file, size));
+       auto io = boost::shared_ptr<MemIO>(new MemIO(*sink, latency, latency));
+       auto allocator = boost::shared_ptr<StorageAllocator>(
+           new StorageAllocator(*sink, 0, size, size));
+       allocator->SetGrowth(size);
+       typedef Registry<MemIO, StorageAllocator> GlobalReg;
+       auto reg = boost::shared_ptr<GlobalReg>(new GlobalReg(1024*1024, io, allocator));
+       typedef PersistentLinkList<int, MemIO, StorageAllocator> PMemLinkList;
+
+       auto start = std::chrono::steady_clock::now();
+       {
+          PMemLinkList list(std::string("bench"), reg, io, allocator);
+          for (int i = 0; i < nops; i++)
+             list.push_back(i);
+       }
+       auto append = std::chrono::steady_clock::now();
+       PMemLinkList list(std::string("bench"), reg, io, allocator);
+       auto end = std::chrono::steady_clock::now();
+
+       // one pass over the records, without the in-memory copy
+       size_t live = 0;
+       {
+          PMemLinkList lazy(std::string("bench"), reg, io, allocator, true);
+          LinkListNode<int> node;
+          for (auto it = lazy.begin(); it.Next(node); )
+             live+=node.data._phys_birth != 0;
+       }
+       assert(live == (size_t)nops);
+       auto streamed = std::chrono::steady_clock::now();
+
+       // the same values again, a thousand per append
+       std::vector<int> batch;
+       {
+          PMemLinkList list(std::string("batch"), reg, io, allocator);
+          for (int i = 0; i < nops; i++) {
+             batch.push_back(i);
+             if (batch.size() == 1000 || i == nops - 1) {
+                list.append(batch.begin(), batch.end());
+                batch.clear();
+             }
+          }
+       }
+       auto batched = std::chrono::steady_clock::now();
+
+       auto usecs = [](std::chrono::steady_clock::duration d) {
+          return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+       };
+       std::cout << "list" << (inmemory ? " (memory" : " (file")
+                 << ", latency " << latency << " us): " << nops << " appends in "
+                 << usecs(append - start) << " us, reopen in "
+                 << usecs(end - append) << " us, streamed in "
+                 << usecs(streamed - end) << " us, batched appends in "
+                 << usecs(batched - streamed) << " us" << std::endl;
+    }
+    remove(path(file));
+}